@@ -52,14 +52,14 @@ public:
 		SplitLongerAxis ///< -LAS
 	};
 
-	/// Inserts a single rectangle into the bin. The packer might rotate the rectangle, in which case the returned
-	/// struct will have the width and height values swapped.
+	/// Inserts a single rectangle into the bin. If rot is set, the packer might rotate the rectangle, in which case
+	/// the returned struct will have the width and height values swapped.
 	/// @param merge If true, performs free Rectangle Merge procedure after packing the new rectangle. This procedure
 	///		tries to defragment the list of disjoint free rectangles to improve packing performance, but also takes up 
 	///		some extra time.
 	/// @param rectChoice The free rectangle choice heuristic rule to use.
 	/// @param splitMethod The free rectangle split heuristic rule to use.
-	Rect Insert(int width, int height, bool merge, FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
+	Rect Insert(int width, int height, bool rot, bool merge, FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
 
 	/// Inserts a list of rectangles into the bin.
 	/// @param rects The list of rectangles to add. This list will be destroyed in the packing process.
@@ -109,7 +109,7 @@ private:
 	/// @param nodeIndex [out] The index of the free rectangle in the freeRectangles array into which the new
 	///		rect was placed.
 	/// @return A Rect structure that represents the placement of the new rect into the best free rectangle.
-	Rect FindPositionForNewNode(int width, int height, FreeRectChoiceHeuristic rectChoice, int *nodeIndex);
+	Rect FindPositionForNewNode(bool rot, int width, int height, FreeRectChoiceHeuristic rectChoice, int *nodeIndex);
 
 	static int ScoreByHeuristic(int width, int height, const Rect &freeRect, FreeRectChoiceHeuristic rectChoice);
 	// The following functions compute (penalty) score values if a rect of the given size was placed into the 
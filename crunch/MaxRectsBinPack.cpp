@@ -15,6 +15,20 @@
 #include <algorithm>
 
 #include "MaxRectsBinPack.h"
+#include "parallel.hpp"
+
+#if defined __x86_64__ || defined __i386__ || defined _M_X64 || defined _M_IX86
+#define RBP_X86
+#include <immintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+#endif
+#if defined _MSC_VER && !defined __clang__
+#define RBP_TARGET(isa)
+#else
+#define RBP_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
 
 namespace rbp {
 
@@ -22,7 +36,12 @@ using namespace std;
 
 MaxRectsBinPack::MaxRectsBinPack()
 :binWidth(0),
-binHeight(0)
+binHeight(0),
+numRemovedRectangles(0),
+numCompactions(0),
+cellShift(0),
+gridWidth(0),
+gridHeight(0)
 {
 }
 
@@ -44,8 +63,23 @@ void MaxRectsBinPack::Init(int width, int height)
 
 	usedRectangles.clear();
 
-	freeRectangles.clear();
-	freeRectangles.push_back(n);
+	// Size the grid cells so there are at most 64 along the longer side of the bin.
+	cellShift = 0;
+	while((max(width, height) - 1) >> cellShift >= 64)
+		++cellShift;
+	gridWidth = max(width - 1, 0) / (1 << cellShift) + 1;
+	gridHeight = max(height - 1, 0) / (1 << cellShift) + 1;
+	grid.assign(gridWidth * gridHeight, std::vector<int>());
+	usedGrid.assign(gridWidth * gridHeight, std::vector<int>());
+
+	freeX.clear();
+	freeY.clear();
+	freeWidth.clear();
+	freeHeight.clear();
+	AddFreeRect(n);
+	numRemovedRectangles = 0;
+	numCompactions = 0;
+	GridAdd(0);
 }
 
 Rect MaxRectsBinPack::Insert(int width, int height, bool rot, FreeRectChoiceHeuristic method)
@@ -54,86 +88,144 @@ Rect MaxRectsBinPack::Insert(int width, int height, bool rot, FreeRectChoiceHeur
 	// Unused in this function. We don't need to know the score after finding the position.
 	int score1 = std::numeric_limits<int>::max();
 	int score2 = std::numeric_limits<int>::max();
-	switch(method)
-	{
-		case RectBestShortSideFit: newNode = FindPositionForNewNodeBestShortSideFit(rot, width, height, score1, score2); break;
-		case RectBottomLeftRule: newNode = FindPositionForNewNodeBottomLeft(rot, width, height, score1, score2); break;
-		case RectContactPointRule: newNode = FindPositionForNewNodeContactPoint(rot, width, height, score1); break;
-		case RectBestLongSideFit: newNode = FindPositionForNewNodeBestLongSideFit(rot, width, height, score2, score1); break;
-		case RectBestAreaFit: newNode = FindPositionForNewNodeBestAreaFit(rot, width, height, score1, score2); break;
-	}
+	if (method == RectContactPointRule)
+		newNode = FindPositionForNewNodeContactPoint(rot, width, height, score1);
+	else
+		newNode = FindPositionForNewNode(method, rot, width, height, score1, score2);
 		
 	if (newNode.height == 0)
 		return newNode;
 
-	size_t numRectanglesToProcess = freeRectangles.size();
-	for(size_t i = 0; i < numRectanglesToProcess; ++i)
-	{
-		if (SplitFreeNode(freeRectangles[i], newNode))
-		{
-			freeRectangles.erase(freeRectangles.begin() + i);
-			--i;
-			--numRectanglesToProcess;
-		}
-	}
-
-	PruneFreeList();
-
-	usedRectangles.push_back(newNode);
+	PlaceRect(newNode);
 	return newNode;
 }
 
-void MaxRectsBinPack::Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, bool rot, FreeRectChoiceHeuristic method)
-{
-	dst.clear();
+/// How many free rectangles a round of batch insertion has to score before it's worth spreading
+/// across threads.
+static const size_t minParallelScores = 1 << 18;
 
-	while(rects.size() > 0)
+void MaxRectsBinPack::Insert(const std::vector<RectSize> &rects, std::vector<Rect> &dst, bool rot, FreeRectChoiceHeuristic method, int jobs)
+{
+	dst.resize(rects.size());
+	memset(dst.data(), 0, dst.size() * sizeof(Rect));
+
+	// The best placement of each rectangle is kept between rounds. A placement only has to be
+	// searched for again when the free rectangle it was in got split, otherwise the only thing
+	// that can beat it is one of the pieces the last round added, which go to the end of the
+	// list. The -CP score depends on the neighbours though, so that variant rescores everything.
+	std::vector<int> score1(rects.size());
+	std::vector<int> score2(rects.size());
+	std::vector<int> keys(rects.size());
+	std::vector<Rect> nodes(method == RectContactPointRule ? rects.size() : 0);
+	std::vector<size_t> remaining(rects.size());
+	for(size_t i = 0; i < rects.size(); ++i)
+		remaining[i] = i;
+
+	size_t firstNew = 0;
+	bool rescoreAll = true;
+	while(remaining.size() > 0)
 	{
-		int bestScore1 = std::numeric_limits<int>::max();
-		int bestScore2 = std::numeric_limits<int>::max();
-		int bestRectIndex = -1;
-		Rect bestNode;
-
-		for(size_t i = 0; i < rects.size(); ++i)
-		{
-			int score1;
-			int score2;
-			Rect newNode = ScoreRect(rects[i].width, rects[i].height, rot, method, score1, score2);
-
-			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
+		// Score in one contiguous chunk per job rather than one rectangle at a time, most of
+		// them only look at a handful of new free rectangles. Starting the threads costs more
+		// than that, so a round only fans out when it has enough free rectangles to look at.
+		size_t numScored = (rescoreAll || method == RectContactPointRule) ? freeX.size() : freeX.size() - firstNew;
+		int roundJobs = remaining.size() * numScored >= minParallelScores ? jobs : 1;
+		size_t numChunks = min(remaining.size(), (size_t)max(roundJobs, 1));
+		ParallelFor(numChunks, roundJobs, [&](size_t chunk) {
+			size_t end = remaining.size() * (chunk + 1) / numChunks;
+			for(size_t j = remaining.size() * chunk / numChunks; j < end; ++j)
 			{
-				bestScore1 = score1;
-				bestScore2 = score2;
-				bestNode = newNode;
-				bestRectIndex = i;
+				size_t i = remaining[j];
+				if (method == RectContactPointRule)
+				{
+					nodes[i] = ScoreRect(rects[i].width, rects[i].height, rot, method, score1[i], score2[i]);
+					keys[i] = nodes[i].height == 0 ? -1 : 0;
+				}
+				else if (rescoreAll || freeWidth[keys[i] / 2] < 0)
+					keys[i] = FindBestFreeRect(method, rot, rects[i].width, rects[i].height, 0, score1[i], score2[i]);
+				else
+				{
+					int newScore1;
+					int newScore2;
+					int newKey = FindBestFreeRect(method, rot, rects[i].width, rects[i].height, firstNew, newScore1, newScore2);
+					if (newKey >= 0 && (newScore1 < score1[i] || (newScore1 == score1[i] && newScore2 < score2[i])))
+					{
+						score1[i] = newScore1;
+						score2[i] = newScore2;
+						keys[i] = newKey;
+					}
+				}
 			}
-		}
+		});
 
-		if (bestRectIndex == -1)
+		// Free space only ever shrinks, so a rectangle that doesn't fit now never will.
+		size_t bestIndex = 0;
+		size_t numKept = 0;
+		for(size_t j = 0; j < remaining.size(); ++j)
+		{
+			size_t i = remaining[j];
+			if (keys[i] < 0)
+				continue;
+			size_t best = remaining[bestIndex];
+			if (numKept == 0 || score1[i] < score1[best] || (score1[i] == score1[best] && score2[i] < score2[best]))
+				bestIndex = numKept;
+			remaining[numKept++] = i;
+		}
+		remaining.resize(numKept);
+		if (numKept == 0)
 			return;
 
-		PlaceRect(bestNode);
-		rects.erase(rects.begin() + bestRectIndex);
+		size_t bestRect = remaining[bestIndex];
+		if (method == RectContactPointRule)
+			dst[bestRect] = nodes[bestRect];
+		else
+			dst[bestRect] = PlacementNode(keys[bestRect], rects[bestRect].width, rects[bestRect].height);
+		remaining.erase(remaining.begin() + bestIndex);
+
+		firstNew = freeX.size();
+		size_t compactions = numCompactions;
+		PlaceRect(dst[bestRect]);
+		rescoreAll = numCompactions != compactions;
 	}
 }
 
 void MaxRectsBinPack::PlaceRect(const Rect &node)
 {
-	size_t numRectanglesToProcess = freeRectangles.size();
-	for(size_t i = 0; i < numRectanglesToProcess; ++i)
-	{
-		if (SplitFreeNode(freeRectangles[i], node))
+	// Only the free rectangles in the grid cells under the node can overlap it. They're split in
+	// list order, and their pieces go to the end of the list, since ties between placements are
+	// decided by that order.
+	std::vector<int> overlapping;
+	int first = GridCell(node.x, node.y);
+	int last = GridCell(node.x + node.width - 1, node.y + node.height - 1);
+	for(int y = first / gridWidth; y <= last / gridWidth; ++y)
+		for(int x = first % gridWidth; x <= last % gridWidth; ++x)
 		{
-			freeRectangles.erase(freeRectangles.begin() + i);
-			--i;
-			--numRectanglesToProcess;
+			const std::vector<int> &cell = grid[y * gridWidth + x];
+			overlapping.insert(overlapping.end(), cell.begin(), cell.end());
 		}
-	}
-
-	PruneFreeList();
-
+	sort(overlapping.begin(), overlapping.end());
+	overlapping.erase(unique(overlapping.begin(), overlapping.end()), overlapping.end());
+
+	size_t firstNew = freeX.size();
+	for(size_t i = 0; i < overlapping.size(); ++i)
+		if (freeWidth[overlapping[i]] >= 0 && SplitFreeNode(FreeRect(overlapping[i]), node))
+			RemoveFreeRect(overlapping[i]);
+	for(size_t i = firstNew; i < freeX.size(); ++i)
+		GridAdd(i);
+
+	// The free rectangles that weren't split were not redundant before, and can't be contained in
+	// a piece of one that was, so only the new pieces need pruning.
+	PruneFreeList(firstNew);
+
+	if (numRemovedRectangles * 2 > freeX.size())
+		CompactFreeList();
+
+	first = GridCell(node.x, node.y);
+	last = GridCell(node.x + node.width - 1, node.y + node.height - 1);
+	for(int y = first / gridWidth; y <= last / gridWidth; ++y)
+		for(int x = first % gridWidth; x <= last % gridWidth; ++x)
+			usedGrid[y * gridWidth + x].push_back((int)usedRectangles.size());
 	usedRectangles.push_back(node);
-	//		dst.push_back(bestNode); ///\todo Refactor so that this compiles.
 }
 
 Rect MaxRectsBinPack::ScoreRect(int width, int height, bool rot, FreeRectChoiceHeuristic method, int &score1, int &score2) const
@@ -141,16 +233,13 @@ Rect MaxRectsBinPack::ScoreRect(int width, int height, bool rot, FreeRectChoiceH
 	Rect newNode;
 	score1 = std::numeric_limits<int>::max();
 	score2 = std::numeric_limits<int>::max();
-	switch(method)
+	if (method == RectContactPointRule)
 	{
-	case RectBestShortSideFit: newNode = FindPositionForNewNodeBestShortSideFit(rot, width, height, score1, score2); break;
-	case RectBottomLeftRule: newNode = FindPositionForNewNodeBottomLeft(rot, width, height, score1, score2); break;
-	case RectContactPointRule: newNode = FindPositionForNewNodeContactPoint(rot, width, height, score1);
+		newNode = FindPositionForNewNodeContactPoint(rot, width, height, score1);
 		score1 = -score1; // Reverse since we are minimizing, but for contact point score bigger is better.
-		break;
-	case RectBestLongSideFit: newNode = FindPositionForNewNodeBestLongSideFit(rot, width, height, score2, score1); break;
-	case RectBestAreaFit: newNode = FindPositionForNewNodeBestAreaFit(rot, width, height, score1, score2); break;
 	}
+	else
+		newNode = FindPositionForNewNode(method, rot, width, height, score1, score2);
 
 	// Cannot fit the current rectangle.
 	if (newNode.height == 0)
@@ -172,210 +261,372 @@ float MaxRectsBinPack::Occupancy() const
 	return (float)usedSurfaceArea / (binWidth * binHeight);
 }
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBottomLeft(bool rot, int width, int height, int &bestY, int &bestX) const
+/// Computes the scores of placing a width x height rectangle into a free rectangle it fits in.
+template<int method>
+static inline void ScorePlacement(int x, int y, int freeWidth, int freeHeight, int width, int height, int &score1, int &score2)
 {
-	Rect bestNode;
-	memset(&bestNode, 0, sizeof(Rect));
-
-	bestY = std::numeric_limits<int>::max();
-	bestX = std::numeric_limits<int>::max();
+	int leftoverHoriz = freeWidth - width;
+	int leftoverVert = freeHeight - height;
+	switch(method)
+	{
+	case MaxRectsBinPack::RectBestShortSideFit:
+		score1 = min(leftoverHoriz, leftoverVert);
+		score2 = max(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBestLongSideFit:
+		score1 = max(leftoverHoriz, leftoverVert);
+		score2 = min(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBestAreaFit:
+		score1 = freeWidth * freeHeight - width * height;
+		score2 = min(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBottomLeftRule:
+		score1 = y + height;
+		score2 = x;
+		break;
+	}
+}
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+/// Goes through the free rectangles from begin to end and keeps the placement with the lowest scores.
+/// Placements are identified by a key of twice the index of their free rectangle, plus one if the
+/// rectangle is flipped. Of equal scores the first placement wins, upright before flipped.
+/// @return The key of the best placement, or bestKey if none was better than the given scores.
+template<int method>
+static int FindBestPlacementScalar(const int *x, const int *y, const int *w, const int *h, size_t begin, size_t end,
+	bool rot, int width, int height, int &bestScore1, int &bestScore2, int bestKey)
+{
+	for(size_t i = begin; i < end; ++i)
 	{
 		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		if (w[i] >= width && h[i] >= height)
 		{
-			int topSideY = freeRectangles[i].y + height;
-			if (topSideY < bestY || (topSideY == bestY && freeRectangles[i].x < bestX))
+			int score1;
+			int score2;
+			ScorePlacement<method>(x[i], y[i], w[i], h[i], width, height, score1, score2);
+			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
 			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestY = topSideY;
-				bestX = freeRectangles[i].x;
+				bestScore1 = score1;
+				bestScore2 = score2;
+				bestKey = (int)i * 2;
+			}
+		}
+
+		if (rot && w[i] >= height && h[i] >= width)
+		{
+			int score1;
+			int score2;
+			ScorePlacement<method>(x[i], y[i], w[i], h[i], height, width, score1, score2);
+			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
+			{
+				bestScore1 = score1;
+				bestScore2 = score2;
+				bestKey = (int)i * 2 + 1;
 			}
 		}
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int topSideY = freeRectangles[i].y + width;
-                if (topSideY < bestY || (topSideY == bestY && freeRectangles[i].x < bestX))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestY = topSideY;
-                    bestX = freeRectangles[i].x;
-                }
-            }
-        }
 	}
-	return bestNode;
+	return bestKey;
 }
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBestShortSideFit(bool rot, int width, int height,
-	int &bestShortSideFit, int &bestLongSideFit) const
-{
-	Rect bestNode;
-	memset(&bestNode, 0, sizeof(Rect));
-
-	bestShortSideFit = std::numeric_limits<int>::max();
-	bestLongSideFit = std::numeric_limits<int>::max();
+#ifdef RBP_X86
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+/// Picks the best of the placements kept in each SIMD lane. Each lane saw its free rectangles in
+/// order, so the lowest key breaks ties between lanes the same way the scalar search would.
+static int ReduceLanes(const int *laneScores1, const int *laneScores2, const int *laneKeys, int numLanes,
+	int &bestScore1, int &bestScore2)
+{
+	int bestKey = -1;
+	for(int i = 0; i < numLanes; ++i)
 	{
-		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		if (laneKeys[i] < 0)
+			continue;
+		if (bestKey < 0 || laneScores1[i] < bestScore1 || (laneScores1[i] == bestScore1 &&
+			(laneScores2[i] < bestScore2 || (laneScores2[i] == bestScore2 && laneKeys[i] < bestKey))))
 		{
-			int leftoverHoriz = abs(freeRectangles[i].width - width);
-			int leftoverVert = abs(freeRectangles[i].height - height);
-			int shortSideFit = min(leftoverHoriz, leftoverVert);
-			int longSideFit = max(leftoverHoriz, leftoverVert);
-
-			if (shortSideFit < bestShortSideFit || (shortSideFit == bestShortSideFit && longSideFit < bestLongSideFit))
-			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestLongSideFit = longSideFit;
-			}
+			bestScore1 = laneScores1[i];
+			bestScore2 = laneScores2[i];
+			bestKey = laneKeys[i];
 		}
+	}
+	return bestKey;
+}
 
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int flippedLeftoverHoriz = abs(freeRectangles[i].width - height);
-                int flippedLeftoverVert = abs(freeRectangles[i].height - width);
-                int flippedShortSideFit = min(flippedLeftoverHoriz, flippedLeftoverVert);
-                int flippedLongSideFit = max(flippedLeftoverHoriz, flippedLeftoverVert);
+enum SimdLevel
+{
+	SimdNone,
+	SimdSse41,
+	SimdAvx2
+};
 
-                if (flippedShortSideFit < bestShortSideFit || (flippedShortSideFit == bestShortSideFit && flippedLongSideFit < bestLongSideFit))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestShortSideFit = flippedShortSideFit;
-                    bestLongSideFit = flippedLongSideFit;
-                }
-            }
-        }
+RBP_TARGET("xsave") static SimdLevel DetectSimdLevel()
+{
+#if defined _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+	bool avx2 = false;
+	if (avx && maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
 	}
-	return bestNode;
+#else
+	__builtin_cpu_init();
+	bool sse41 = __builtin_cpu_supports("sse4.1") != 0;
+	bool avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+	if (avx2)
+		return SimdAvx2;
+	if (sse41)
+		return SimdSse41;
+	return SimdNone;
 }
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBestLongSideFit(bool rot, int width, int height,
-	int &bestShortSideFit, int &bestLongSideFit) const
+static SimdLevel GetSimdLevel()
 {
-	Rect bestNode;
-	memset(&bestNode, 0, sizeof(Rect));
+	static const SimdLevel level = DetectSimdLevel();
+	return level;
+}
 
-	bestShortSideFit = std::numeric_limits<int>::max();
-	bestLongSideFit = std::numeric_limits<int>::max();
+/// Computes the scores of placing a width x height rectangle into 8 free rectangles at once, and
+/// (INT_MAX, INT_MAX) for the free rectangles it doesn't fit into.
+template<int method>
+RBP_TARGET("avx2") static inline void ScorePlacementsAvx2(__m256i x, __m256i y, __m256i w, __m256i h,
+	int width, int height, __m256i &score1, __m256i &score2)
+{
+	const __m256i maxScore = _mm256_set1_epi32(std::numeric_limits<int>::max());
+	__m256i fits = _mm256_and_si256(_mm256_cmpgt_epi32(w, _mm256_set1_epi32(width - 1)),
+		_mm256_cmpgt_epi32(h, _mm256_set1_epi32(height - 1)));
+	__m256i leftoverHoriz = _mm256_sub_epi32(w, _mm256_set1_epi32(width));
+	__m256i leftoverVert = _mm256_sub_epi32(h, _mm256_set1_epi32(height));
+	switch(method)
+	{
+	case MaxRectsBinPack::RectBestShortSideFit:
+		score1 = _mm256_min_epi32(leftoverHoriz, leftoverVert);
+		score2 = _mm256_max_epi32(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBestLongSideFit:
+		score1 = _mm256_max_epi32(leftoverHoriz, leftoverVert);
+		score2 = _mm256_min_epi32(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBestAreaFit:
+		score1 = _mm256_sub_epi32(_mm256_mullo_epi32(w, h), _mm256_set1_epi32(width * height));
+		score2 = _mm256_min_epi32(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBottomLeftRule:
+		score1 = _mm256_add_epi32(y, _mm256_set1_epi32(height));
+		score2 = x;
+		break;
+	}
+	score1 = _mm256_blendv_epi8(maxScore, score1, fits);
+	score2 = _mm256_blendv_epi8(maxScore, score2, fits);
+}
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+/// Runs the search over the free rectangles 8 at a time, keeping the best placement in each lane.
+/// @return The number of free rectangles searched, the rest are left for the scalar search.
+template<int method>
+RBP_TARGET("avx2") static size_t FindBestPlacementAvx2(const int *x, const int *y, const int *w, const int *h, size_t count,
+	bool rot, int width, int height, int &bestScore1, int &bestScore2, int &bestKey)
+{
+	__m256i best1 = _mm256_set1_epi32(std::numeric_limits<int>::max());
+	__m256i best2 = best1;
+	__m256i bestKeys = _mm256_set1_epi32(-1);
+	__m256i keys = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+	const __m256i keyStep = _mm256_set1_epi32(16);
+	const __m256i flipped = _mm256_set1_epi32(1);
+
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
 	{
-		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		__m256i vx = _mm256_loadu_si256((const __m256i *)(x + i));
+		__m256i vy = _mm256_loadu_si256((const __m256i *)(y + i));
+		__m256i vw = _mm256_loadu_si256((const __m256i *)(w + i));
+		__m256i vh = _mm256_loadu_si256((const __m256i *)(h + i));
+
+		__m256i score1;
+		__m256i score2;
+		ScorePlacementsAvx2<method>(vx, vy, vw, vh, width, height, score1, score2);
+		__m256i better = _mm256_or_si256(_mm256_cmpgt_epi32(best1, score1),
+			_mm256_and_si256(_mm256_cmpeq_epi32(best1, score1), _mm256_cmpgt_epi32(best2, score2)));
+		best1 = _mm256_blendv_epi8(best1, score1, better);
+		best2 = _mm256_blendv_epi8(best2, score2, better);
+		bestKeys = _mm256_blendv_epi8(bestKeys, keys, better);
+
+		if (rot)
 		{
-			int leftoverHoriz = abs(freeRectangles[i].width - width);
-			int leftoverVert = abs(freeRectangles[i].height - height);
-			int shortSideFit = min(leftoverHoriz, leftoverVert);
-			int longSideFit = max(leftoverHoriz, leftoverVert);
-
-			if (longSideFit < bestLongSideFit || (longSideFit == bestLongSideFit && shortSideFit < bestShortSideFit))
-			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestLongSideFit = longSideFit;
-			}
+			ScorePlacementsAvx2<method>(vx, vy, vw, vh, height, width, score1, score2);
+			better = _mm256_or_si256(_mm256_cmpgt_epi32(best1, score1),
+				_mm256_and_si256(_mm256_cmpeq_epi32(best1, score1), _mm256_cmpgt_epi32(best2, score2)));
+			best1 = _mm256_blendv_epi8(best1, score1, better);
+			best2 = _mm256_blendv_epi8(best2, score2, better);
+			bestKeys = _mm256_blendv_epi8(bestKeys, _mm256_add_epi32(keys, flipped), better);
 		}
+		keys = _mm256_add_epi32(keys, keyStep);
+	}
 
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int leftoverHoriz = abs(freeRectangles[i].width - height);
-                int leftoverVert = abs(freeRectangles[i].height - width);
-                int shortSideFit = min(leftoverHoriz, leftoverVert);
-                int longSideFit = max(leftoverHoriz, leftoverVert);
-                
-                if (longSideFit < bestLongSideFit || (longSideFit == bestLongSideFit && shortSideFit < bestShortSideFit))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestShortSideFit = shortSideFit;
-                    bestLongSideFit = longSideFit;
-                }
-            }
-        }
+	int laneScores1[8];
+	int laneScores2[8];
+	int laneKeys[8];
+	_mm256_storeu_si256((__m256i *)laneScores1, best1);
+	_mm256_storeu_si256((__m256i *)laneScores2, best2);
+	_mm256_storeu_si256((__m256i *)laneKeys, bestKeys);
+	bestKey = ReduceLanes(laneScores1, laneScores2, laneKeys, 8, bestScore1, bestScore2);
+	return i;
+}
+
+/// The same as ScorePlacementsAvx2, 4 free rectangles at a time.
+template<int method>
+RBP_TARGET("sse4.1") static inline void ScorePlacementsSse41(__m128i x, __m128i y, __m128i w, __m128i h,
+	int width, int height, __m128i &score1, __m128i &score2)
+{
+	const __m128i maxScore = _mm_set1_epi32(std::numeric_limits<int>::max());
+	__m128i fits = _mm_and_si128(_mm_cmpgt_epi32(w, _mm_set1_epi32(width - 1)),
+		_mm_cmpgt_epi32(h, _mm_set1_epi32(height - 1)));
+	__m128i leftoverHoriz = _mm_sub_epi32(w, _mm_set1_epi32(width));
+	__m128i leftoverVert = _mm_sub_epi32(h, _mm_set1_epi32(height));
+	switch(method)
+	{
+	case MaxRectsBinPack::RectBestShortSideFit:
+		score1 = _mm_min_epi32(leftoverHoriz, leftoverVert);
+		score2 = _mm_max_epi32(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBestLongSideFit:
+		score1 = _mm_max_epi32(leftoverHoriz, leftoverVert);
+		score2 = _mm_min_epi32(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBestAreaFit:
+		score1 = _mm_sub_epi32(_mm_mullo_epi32(w, h), _mm_set1_epi32(width * height));
+		score2 = _mm_min_epi32(leftoverHoriz, leftoverVert);
+		break;
+	case MaxRectsBinPack::RectBottomLeftRule:
+		score1 = _mm_add_epi32(y, _mm_set1_epi32(height));
+		score2 = x;
+		break;
 	}
-	return bestNode;
+	score1 = _mm_blendv_epi8(maxScore, score1, fits);
+	score2 = _mm_blendv_epi8(maxScore, score2, fits);
 }
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBestAreaFit(bool rot, int width, int height,
-	int &bestAreaFit, int &bestShortSideFit) const
+/// The same as FindBestPlacementAvx2, 4 free rectangles at a time.
+template<int method>
+RBP_TARGET("sse4.1") static size_t FindBestPlacementSse41(const int *x, const int *y, const int *w, const int *h, size_t count,
+	bool rot, int width, int height, int &bestScore1, int &bestScore2, int &bestKey)
 {
-	Rect bestNode;
-	memset(&bestNode, 0, sizeof(Rect));
+	__m128i best1 = _mm_set1_epi32(std::numeric_limits<int>::max());
+	__m128i best2 = best1;
+	__m128i bestKeys = _mm_set1_epi32(-1);
+	__m128i keys = _mm_setr_epi32(0, 2, 4, 6);
+	const __m128i keyStep = _mm_set1_epi32(8);
+	const __m128i flipped = _mm_set1_epi32(1);
+
+	size_t i = 0;
+	for(; i + 4 <= count; i += 4)
+	{
+		__m128i vx = _mm_loadu_si128((const __m128i *)(x + i));
+		__m128i vy = _mm_loadu_si128((const __m128i *)(y + i));
+		__m128i vw = _mm_loadu_si128((const __m128i *)(w + i));
+		__m128i vh = _mm_loadu_si128((const __m128i *)(h + i));
+
+		__m128i score1;
+		__m128i score2;
+		ScorePlacementsSse41<method>(vx, vy, vw, vh, width, height, score1, score2);
+		__m128i better = _mm_or_si128(_mm_cmpgt_epi32(best1, score1),
+			_mm_and_si128(_mm_cmpeq_epi32(best1, score1), _mm_cmpgt_epi32(best2, score2)));
+		best1 = _mm_blendv_epi8(best1, score1, better);
+		best2 = _mm_blendv_epi8(best2, score2, better);
+		bestKeys = _mm_blendv_epi8(bestKeys, keys, better);
+
+		if (rot)
+		{
+			ScorePlacementsSse41<method>(vx, vy, vw, vh, height, width, score1, score2);
+			better = _mm_or_si128(_mm_cmpgt_epi32(best1, score1),
+				_mm_and_si128(_mm_cmpeq_epi32(best1, score1), _mm_cmpgt_epi32(best2, score2)));
+			best1 = _mm_blendv_epi8(best1, score1, better);
+			best2 = _mm_blendv_epi8(best2, score2, better);
+			bestKeys = _mm_blendv_epi8(bestKeys, _mm_add_epi32(keys, flipped), better);
+		}
+		keys = _mm_add_epi32(keys, keyStep);
+	}
 
-	bestAreaFit = std::numeric_limits<int>::max();
-	bestShortSideFit = std::numeric_limits<int>::max();
+	int laneScores1[4];
+	int laneScores2[4];
+	int laneKeys[4];
+	_mm_storeu_si128((__m128i *)laneScores1, best1);
+	_mm_storeu_si128((__m128i *)laneScores2, best2);
+	_mm_storeu_si128((__m128i *)laneKeys, bestKeys);
+	bestKey = ReduceLanes(laneScores1, laneScores2, laneKeys, 4, bestScore1, bestScore2);
+	return i;
+}
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
-	{
-		int areaFit = freeRectangles[i].width * freeRectangles[i].height - width * height;
+#endif
 
-		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
-		{
-			int leftoverHoriz = abs(freeRectangles[i].width - width);
-			int leftoverVert = abs(freeRectangles[i].height - height);
-			int shortSideFit = min(leftoverHoriz, leftoverVert);
+/// Searches the free rectangles with the widest instruction set the CPU supports.
+/// @return The key of the best placement, or -1 if the rectangle doesn't fit anywhere.
+template<int method>
+static int FindBestPlacement(const int *x, const int *y, const int *w, const int *h, size_t count,
+	bool rot, int width, int height, int &bestScore1, int &bestScore2)
+{
+	bestScore1 = std::numeric_limits<int>::max();
+	bestScore2 = std::numeric_limits<int>::max();
+	int bestKey = -1;
+	size_t numSearched = 0;
+#ifdef RBP_X86
+	switch(GetSimdLevel())
+	{
+	case SimdAvx2: numSearched = FindBestPlacementAvx2<method>(x, y, w, h, count, rot, width, height, bestScore1, bestScore2, bestKey); break;
+	case SimdSse41: numSearched = FindBestPlacementSse41<method>(x, y, w, h, count, rot, width, height, bestScore1, bestScore2, bestKey); break;
+	case SimdNone: break;
+	}
+#endif
+	return FindBestPlacementScalar<method>(x, y, w, h, numSearched, count, rot, width, height, bestScore1, bestScore2, bestKey);
+}
 
-			if (areaFit < bestAreaFit || (areaFit == bestAreaFit && shortSideFit < bestShortSideFit))
-			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestAreaFit = areaFit;
-			}
-		}
+int MaxRectsBinPack::FindBestFreeRect(FreeRectChoiceHeuristic method, bool rot, int width, int height, size_t first,
+	int &score1, int &score2) const
+{
+	// Searching from an offset into the arrays gives keys relative to it, so shift them back.
+	const int *x = freeX.data() + first;
+	const int *y = freeY.data() + first;
+	const int *w = freeWidth.data() + first;
+	const int *h = freeHeight.data() + first;
+	size_t count = freeX.size() - first;
+	int bestKey = -1;
+	score1 = std::numeric_limits<int>::max();
+	score2 = std::numeric_limits<int>::max();
+	switch(method)
+	{
+	case RectBestShortSideFit: bestKey = FindBestPlacement<RectBestShortSideFit>(x, y, w, h, count, rot, width, height, score1, score2); break;
+	case RectBestLongSideFit: bestKey = FindBestPlacement<RectBestLongSideFit>(x, y, w, h, count, rot, width, height, score1, score2); break;
+	case RectBestAreaFit: bestKey = FindBestPlacement<RectBestAreaFit>(x, y, w, h, count, rot, width, height, score1, score2); break;
+	case RectBottomLeftRule: bestKey = FindBestPlacement<RectBottomLeftRule>(x, y, w, h, count, rot, width, height, score1, score2); break;
+	case RectContactPointRule: break;
+	}
+	return bestKey >= 0 ? bestKey + (int)first * 2 : -1;
+}
 
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int leftoverHoriz = abs(freeRectangles[i].width - height);
-                int leftoverVert = abs(freeRectangles[i].height - width);
-                int shortSideFit = min(leftoverHoriz, leftoverVert);
-                
-                if (areaFit < bestAreaFit || (areaFit == bestAreaFit && shortSideFit < bestShortSideFit))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestShortSideFit = shortSideFit;
-                    bestAreaFit = areaFit;
-                }
-            }
-        }
+Rect MaxRectsBinPack::PlacementNode(int key, int width, int height) const
+{
+	Rect node;
+	memset(&node, 0, sizeof(Rect));
+	if (key >= 0)
+	{
+		size_t i = key / 2;
+		bool flipped = (key & 1) != 0;
+		node.x = freeX[i];
+		node.y = freeY[i];
+		node.width = flipped ? height : width;
+		node.height = flipped ? width : height;
 	}
-	return bestNode;
+	return node;
+}
+
+Rect MaxRectsBinPack::FindPositionForNewNode(FreeRectChoiceHeuristic method, bool rot, int width, int height,
+	int &score1, int &score2) const
+{
+	return PlacementNode(FindBestFreeRect(method, rot, width, height, 0, score1, score2), width, height);
 }
 
 /// Returns 0 if the two intervals i1 and i2 are disjoint, or the length of their overlap otherwise.
@@ -395,13 +646,28 @@ int MaxRectsBinPack::ContactPointScoreNode(int x, int y, int width, int height)
 	if (y == 0 || y + height == binHeight)
 		score += width;
 
-	for(size_t i = 0; i < usedRectangles.size(); ++i)
-	{
-		if (usedRectangles[i].x == x + width || usedRectangles[i].x + usedRectangles[i].width == x)
-			score += CommonIntervalLength(usedRectangles[i].y, usedRectangles[i].y + usedRectangles[i].height, y, y + height);
-		if (usedRectangles[i].y == y + height || usedRectangles[i].y + usedRectangles[i].height == y)
-			score += CommonIntervalLength(usedRectangles[i].x, usedRectangles[i].x + usedRectangles[i].width, x, x + width);
-	}
+	// Only the used rectangles that overlap the node grown by one on every side can touch it. Each
+	// one is counted in the grid cell that holds the top-left corner of that overlap, so that a
+	// rectangle listed in several of the cells is only counted once.
+	int left = x - 1;
+	int top = y - 1;
+	int first = GridCell(left, top);
+	int last = GridCell(x + width, y + height);
+	for(int cellY = first / gridWidth; cellY <= last / gridWidth; ++cellY)
+		for(int cellX = first % gridWidth; cellX <= last % gridWidth; ++cellX)
+		{
+			int cell = cellY * gridWidth + cellX;
+			for(size_t i = 0; i < usedGrid[cell].size(); ++i)
+			{
+				const Rect &used = usedRectangles[usedGrid[cell][i]];
+				if (GridCell(max(used.x, left), max(used.y, top)) != cell)
+					continue;
+				if (used.x == x + width || used.x + used.width == x)
+					score += CommonIntervalLength(used.y, used.y + used.height, y, y + height);
+				if (used.y == y + height || used.y + used.height == y)
+					score += CommonIntervalLength(used.x, used.x + used.width, x, x + width);
+			}
+		}
 	return score;
 }
 
@@ -412,16 +678,16 @@ Rect MaxRectsBinPack::FindPositionForNewNodeContactPoint(bool rot, int width, in
 
 	bestContactScore = -1;
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	for(size_t i = 0; i < freeX.size(); ++i)
 	{
 		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		if (freeWidth[i] >= width && freeHeight[i] >= height)
 		{
-			int score = ContactPointScoreNode(freeRectangles[i].x, freeRectangles[i].y, width, height);
+			int score = ContactPointScoreNode(freeX[i], freeY[i], width, height);
 			if (score > bestContactScore)
 			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
+				bestNode.x = freeX[i];
+				bestNode.y = freeY[i];
 				bestNode.width = width;
 				bestNode.height = height;
 				bestContactScore = score;
@@ -430,13 +696,13 @@ Rect MaxRectsBinPack::FindPositionForNewNodeContactPoint(bool rot, int width, in
         
         if (rot)
         {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
+            if (freeWidth[i] >= height && freeHeight[i] >= width)
             {
-                int score = ContactPointScoreNode(freeRectangles[i].x, freeRectangles[i].y, height, width);
+                int score = ContactPointScoreNode(freeX[i], freeY[i], height, width);
                 if (score > bestContactScore)
                 {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
+                    bestNode.x = freeX[i];
+                    bestNode.y = freeY[i];
                     bestNode.width = height;
                     bestNode.height = width;
                     bestContactScore = score;
@@ -461,7 +727,7 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 		{
 			Rect newNode = freeNode;
 			newNode.height = usedNode.y - newNode.y;
-			freeRectangles.push_back(newNode);
+			AddFreeRect(newNode);
 		}
 
 		// New node at the bottom side of the used node.
@@ -470,7 +736,7 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 			Rect newNode = freeNode;
 			newNode.y = usedNode.y + usedNode.height;
 			newNode.height = freeNode.y + freeNode.height - (usedNode.y + usedNode.height);
-			freeRectangles.push_back(newNode);
+			AddFreeRect(newNode);
 		}
 	}
 
@@ -481,7 +747,7 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 		{
 			Rect newNode = freeNode;
 			newNode.width = usedNode.x - newNode.x;
-			freeRectangles.push_back(newNode);
+			AddFreeRect(newNode);
 		}
 
 		// New node at the right side of the used node.
@@ -490,50 +756,111 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 			Rect newNode = freeNode;
 			newNode.x = usedNode.x + usedNode.width;
 			newNode.width = freeNode.x + freeNode.width - (usedNode.x + usedNode.width);
-			freeRectangles.push_back(newNode);
+			AddFreeRect(newNode);
 		}
 	}
 
 	return true;
 }
 
-void MaxRectsBinPack::PruneFreeList()
+void MaxRectsBinPack::PruneFreeList(size_t first)
 {
-	/* 
-	///  Would be nice to do something like this, to avoid a Theta(n^2) loop through each pair.
-	///  But unfortunately it doesn't quite cut it, since we also want to detect containment. 
-	///  Perhaps there's another way to do this faster than Theta(n^2).
+	/// A free rectangle is redundant if it's contained in another one. Doing that pairwise is
+	/// Theta(n^2), but anything containing a rectangle has to cover its top-left corner, so only
+	/// the free rectangles in that grid cell need to be checked. Of several identical rectangles
+	/// the last one is kept, which is the order the pairwise check used to leave them in.
+	for(size_t i = first; i < freeX.size(); ++i)
+		if (IsRedundant(FreeRect(i)))
+			RemoveFreeRect(i);
+}
 
-	if (freeRectangles.size() > 0)
-		clb::sort::QuickSort(&freeRectangles[0], freeRectangles.size(), NodeSortCmp);
+static bool IsSameRect(const Rect &a, const Rect &b)
+{
+	return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
 
-	for(size_t i = 0; i < freeRectangles.size()-1; ++i)
-		if (freeRectangles[i].x == freeRectangles[i+1].x &&
-		    freeRectangles[i].y == freeRectangles[i+1].y &&
-		    freeRectangles[i].width == freeRectangles[i+1].width &&
-		    freeRectangles[i].height == freeRectangles[i+1].height)
+bool MaxRectsBinPack::IsRedundant(const Rect &freeNode) const
+{
+	const std::vector<int> &cell = grid[GridCell(freeNode.x, freeNode.y)];
+	int numSame = 0;
+	for(size_t i = 0; i < cell.size(); ++i)
+	{
+		Rect other = FreeRect(cell[i]);
+		if (IsContainedIn(freeNode, other))
 		{
-			freeRectangles.erase(freeRectangles.begin() + i);
-			--i;
+			if (!IsSameRect(freeNode, other))
+				return true;
+			++numSame;
 		}
-	*/
+	}
+	return numSame > 1;
+}
 
-	/// Go through each pair and remove any rectangle that is redundant.
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
-		for(size_t j = i+1; j < freeRectangles.size(); ++j)
+Rect MaxRectsBinPack::FreeRect(size_t index) const
+{
+	Rect freeNode;
+	freeNode.x = freeX[index];
+	freeNode.y = freeY[index];
+	freeNode.width = freeWidth[index];
+	freeNode.height = freeHeight[index];
+	return freeNode;
+}
+
+void MaxRectsBinPack::AddFreeRect(const Rect &freeNode)
+{
+	freeX.push_back(freeNode.x);
+	freeY.push_back(freeNode.y);
+	freeWidth.push_back(freeNode.width);
+	freeHeight.push_back(freeNode.height);
+}
+
+void MaxRectsBinPack::RemoveFreeRect(size_t index)
+{
+	freeWidth[index] = -1;
+	freeHeight[index] = -1;
+	++numRemovedRectangles;
+}
+
+void MaxRectsBinPack::CompactFreeList()
+{
+	size_t numKept = 0;
+	for(size_t i = 0; i < freeX.size(); ++i)
+		if (freeWidth[i] >= 0)
 		{
-			if (IsContainedIn(freeRectangles[i], freeRectangles[j]))
-			{
-				freeRectangles.erase(freeRectangles.begin()+i);
-				--i;
-				break;
-			}
-			if (IsContainedIn(freeRectangles[j], freeRectangles[i]))
-			{
-				freeRectangles.erase(freeRectangles.begin()+j);
-				--j;
-			}
+			freeX[numKept] = freeX[i];
+			freeY[numKept] = freeY[i];
+			freeWidth[numKept] = freeWidth[i];
+			freeHeight[numKept] = freeHeight[i];
+			++numKept;
 		}
+	freeX.resize(numKept);
+	freeY.resize(numKept);
+	freeWidth.resize(numKept);
+	freeHeight.resize(numKept);
+	numRemovedRectangles = 0;
+	++numCompactions;
+
+	for(size_t i = 0; i < grid.size(); ++i)
+		grid[i].clear();
+	for(size_t i = 0; i < freeX.size(); ++i)
+		GridAdd(i);
+}
+
+int MaxRectsBinPack::GridCell(int x, int y) const
+{
+	int cellX = min(max(x >> cellShift, 0), gridWidth - 1);
+	int cellY = min(max(y >> cellShift, 0), gridHeight - 1);
+	return cellY * gridWidth + cellX;
+}
+
+void MaxRectsBinPack::GridAdd(size_t index)
+{
+	Rect freeNode = FreeRect(index);
+	int first = GridCell(freeNode.x, freeNode.y);
+	int last = GridCell(freeNode.x + freeNode.width - 1, freeNode.y + freeNode.height - 1);
+	for(int y = first / gridWidth; y <= last / gridWidth; ++y)
+		for(int x = first % gridWidth; x <= last % gridWidth; ++x)
+			grid[y * gridWidth + x].push_back((int)index);
 }
 
 }
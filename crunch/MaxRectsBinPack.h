@@ -38,11 +38,13 @@ public:
 		RectContactPointRule ///< -CP: Choosest the placement where the rectangle touches other rects as much as possible.
 	};
 
-	/// Inserts the given list of rectangles in an offline/batch mode, possibly rotated.
-	/// @param rects The list of rectangles to insert. This vector will be destroyed in the process.
-	/// @param dst [out] This list will contain the packed rectangles. The indices will not correspond to that of rects.
+	/// Inserts the given list of rectangles in an offline/batch mode, possibly rotated. Each round places
+	/// whichever of the remaining rectangles scores best, of equal ones the first in the list.
+	/// @param rects The list of rectangles to insert.
+	/// @param dst [out] The packed rectangles, where dst[i] is where rects[i] went, or has zero size if it didn't fit.
 	/// @param method The rectangle placement rule to use when packing.
-	void Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, bool rot, FreeRectChoiceHeuristic method);
+	/// @param jobs How many threads to score the remaining rectangles on each round.
+	void Insert(const std::vector<RectSize> &rects, std::vector<Rect> &dst, bool rot, FreeRectChoiceHeuristic method, int jobs);
 
 	/// Inserts a single rectangle into the bin, possibly rotated.
 	Rect Insert(int width, int height, bool rot, FreeRectChoiceHeuristic method);
@@ -50,12 +52,39 @@ public:
 	/// Computes the ratio of used surface area to the total bin area.
 	float Occupancy() const;
 
+	/// Places the given rectangle into the bin at its own position, marking that area as used.
+	void PlaceRect(const Rect &node);
+
 private:
 	int binWidth;
 	int binHeight;
 
 	std::vector<Rect> usedRectangles;
-	std::vector<Rect> freeRectangles;
+
+	/// The free rectangles, kept as separate arrays of their x, y, width and height so that several
+	/// of them can be scored at a time. Free rectangles that get split or pruned are left in the
+	/// list with a negative size, which no fit check can pass, and the list is only compacted once
+	/// they outnumber the live ones.
+	std::vector<int> freeX;
+	std::vector<int> freeY;
+	std::vector<int> freeWidth;
+	std::vector<int> freeHeight;
+	size_t numRemovedRectangles;
+
+	/// How many times the free list has been compacted, which changes the indices of the free rectangles.
+	size_t numCompactions;
+
+	/// A uniform grid over the bin where each cell lists the indices of the free rectangles that
+	/// overlap it, so the free rectangles around an area can be found without going through all of them.
+	/// Removed free rectangles stay in the cells until the list is compacted.
+	int cellShift;
+	int gridWidth;
+	int gridHeight;
+	std::vector<std::vector<int> > grid;
+
+	/// The indices of the used rectangles that overlap each grid cell, so the -CP variant only has to
+	/// look at the ones around a position.
+	std::vector<std::vector<int> > usedGrid;
 
 	/// Computes the placement score for placing the given rectangle with the given method.
 	/// @param score1 [out] The primary placement score will be outputted here.
@@ -63,23 +92,43 @@ private:
 	/// @return This struct identifies where the rectangle would be placed if it were placed.
 	Rect ScoreRect(int width, int height, bool rot, FreeRectChoiceHeuristic method, int &score1, int &score2) const;
 
-	/// Places the given rectangle into the bin.
-	void PlaceRect(const Rect &node);
-
 	/// Computes the placement score for the -CP variant.
 	int ContactPointScoreNode(int x, int y, int width, int height) const;
 
-	Rect FindPositionForNewNodeBottomLeft(bool rot, int width, int height, int &bestY, int &bestX) const;
-	Rect FindPositionForNewNodeBestShortSideFit(bool rot, int width, int height, int &bestShortSideFit, int &bestLongSideFit) const;
-	Rect FindPositionForNewNodeBestLongSideFit(bool rot, int width, int height, int &bestShortSideFit, int &bestLongSideFit) const;
-	Rect FindPositionForNewNodeBestAreaFit(bool rot, int width, int height, int &bestAreaFit, int &bestShortSideFit) const;
+	/// Finds the best position for the -BSSF, -BLSF, -BAF and -BL variants.
+	/// @param score1 [out] The primary placement score of the position, lower is better.
+	/// @param score2 [out] The secondary placement score, which breaks ties.
+	Rect FindPositionForNewNode(FreeRectChoiceHeuristic method, bool rot, int width, int height, int &score1, int &score2) const;
 	Rect FindPositionForNewNodeContactPoint(bool rot, int width, int height, int &contactScore) const;
 
+	/// Finds the best placement for the -BSSF, -BLSF, -BAF and -BL variants among the free rectangles from the given index on.
+	/// @return The index of the free rectangle times two, plus one if the rectangle is flipped there, or -1 if it fits in none of them.
+	int FindBestFreeRect(FreeRectChoiceHeuristic method, bool rot, int width, int height, size_t first, int &score1, int &score2) const;
+
+	/// @return Where the rectangle goes for a placement returned by FindBestFreeRect, or a zero size rectangle for -1.
+	Rect PlacementNode(int key, int width, int height) const;
+
 	/// @return True if the free node was split.
 	bool SplitFreeNode(Rect freeNode, const Rect &usedNode);
 
-	/// Goes through the free rectangle list and removes any redundant entries.
-	void PruneFreeList();
+	/// Goes through the free rectangles from the given index on and removes any redundant entries.
+	void PruneFreeList(size_t first);
+
+	/// @return True if the given free rectangle is contained in another one, or is the first of several identical ones.
+	bool IsRedundant(const Rect &freeNode) const;
+
+	Rect FreeRect(size_t index) const;
+	void AddFreeRect(const Rect &freeNode);
+
+	/// Marks the free rectangle at the given index as removed.
+	void RemoveFreeRect(size_t index);
+
+	/// Drops the removed free rectangles from the list, keeping the order of the rest.
+	void CompactFreeList();
+
+	/// @return The index of the grid cell that contains the given point.
+	int GridCell(int x, int y) const;
+	void GridAdd(size_t index);
 };
 
 }
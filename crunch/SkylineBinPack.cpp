@@ -0,0 +1,344 @@
+/** @file SkylineBinPack.cpp
+	@author Jukka Jylnki
+
+	@brief Implements different bin packer algorithms that use the SKYLINE data structure.
+
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "SkylineBinPack.h"
+
+namespace rbp {
+
+using namespace std;
+
+SkylineBinPack::SkylineBinPack()
+:binWidth(0),
+binHeight(0),
+usedSurfaceArea(0),
+useWasteMap(false)
+{
+}
+
+SkylineBinPack::SkylineBinPack(int width, int height, bool useWasteMap)
+{
+	Init(width, height, useWasteMap);
+}
+
+void SkylineBinPack::Init(int width, int height, bool useWasteMap_)
+{
+	binWidth = width;
+	binHeight = height;
+
+	useWasteMap = useWasteMap_;
+
+#ifdef _DEBUG
+	disjointRects.Clear();
+#endif
+
+	usedSurfaceArea = 0;
+	skyLine.clear();
+	SkylineNode node;
+	node.x = 0;
+	node.y = 0;
+	node.width = binWidth;
+	skyLine.push_back(node);
+
+	if (useWasteMap)
+	{
+		wasteMap.Init(width, height);
+		wasteMap.GetFreeRectangles().clear();
+	}
+}
+
+Rect SkylineBinPack::Insert(int width, int height, bool rot, LevelChoiceHeuristic method)
+{
+	Rect node;
+	memset(&node, 0, sizeof(Rect));
+	switch(method)
+	{
+	case LevelBottomLeft: node = InsertBottomLeft(width, height, rot); break;
+	case LevelMinWasteFit: node = InsertMinWaste(width, height, rot); break;
+	}
+	if (node.height != 0 || !useWasteMap)
+		return node;
+
+	// Only fall back to the waste map once the rectangle doesn't fit on the skyline. Going through its
+	// free rectangles first would cost every placement time proportional to how many rectangles were
+	// packed, rather than to the number of skyline segments. The free rectangles aren't merged either,
+	// that goes through all pairs of them.
+	node = wasteMap.Insert(width, height, rot, false, GuillotineBinPack::RectBestShortSideFit, GuillotineBinPack::SplitMaximizeArea);
+	debug_assert(disjointRects.Disjoint(node));
+
+	if (node.height != 0)
+	{
+		usedSurfaceArea += width * height;
+#ifdef _DEBUG
+		disjointRects.Add(node);
+#endif
+	}
+	return node;
+}
+
+bool SkylineBinPack::RectangleFits(int skylineNodeIndex, int width, int height, int &y) const
+{
+	int x = skyLine[skylineNodeIndex].x;
+	if (x + width > binWidth)
+		return false;
+	int widthLeft = width;
+	int i = skylineNodeIndex;
+	y = skyLine[skylineNodeIndex].y;
+	while(widthLeft > 0)
+	{
+		y = max(y, skyLine[i].y);
+		if (y + height > binHeight)
+			return false;
+		widthLeft -= skyLine[i].width;
+		++i;
+		assert(i < (int)skyLine.size() || widthLeft <= 0);
+	}
+	return true;
+}
+
+int SkylineBinPack::ComputeWastedArea(int skylineNodeIndex, int width, int y) const
+{
+	int wastedArea = 0;
+	const int rectLeft = skyLine[skylineNodeIndex].x;
+	const int rectRight = rectLeft + width;
+	for(; skylineNodeIndex < (int)skyLine.size() && skyLine[skylineNodeIndex].x < rectRight; ++skylineNodeIndex)
+	{
+		int leftSide = skyLine[skylineNodeIndex].x;
+		int rightSide = min(rectRight, leftSide + skyLine[skylineNodeIndex].width);
+		assert(y >= skyLine[skylineNodeIndex].y);
+		wastedArea += (rightSide - leftSide) * (y - skyLine[skylineNodeIndex].y);
+	}
+	return wastedArea;
+}
+
+bool SkylineBinPack::RectangleFits(int skylineNodeIndex, int width, int height, int &y, int &wastedArea) const
+{
+	bool fits = RectangleFits(skylineNodeIndex, width, height, y);
+	if (fits)
+		wastedArea = ComputeWastedArea(skylineNodeIndex, width, y);
+
+	return fits;
+}
+
+void SkylineBinPack::AddWasteMapArea(int skylineNodeIndex, int width, int y)
+{
+	const int rectLeft = skyLine[skylineNodeIndex].x;
+	const int rectRight = rectLeft + width;
+	for(; skylineNodeIndex < (int)skyLine.size() && skyLine[skylineNodeIndex].x < rectRight; ++skylineNodeIndex)
+	{
+		int leftSide = skyLine[skylineNodeIndex].x;
+		int rightSide = min(rectRight, leftSide + skyLine[skylineNodeIndex].width);
+		assert(y >= skyLine[skylineNodeIndex].y);
+
+		// Segments the rectangle sits right on top of leave nothing behind.
+		if (y == skyLine[skylineNodeIndex].y)
+			continue;
+
+		Rect waste;
+		waste.x = leftSide;
+		waste.y = skyLine[skylineNodeIndex].y;
+		waste.width = rightSide - leftSide;
+		waste.height = y - skyLine[skylineNodeIndex].y;
+
+		debug_assert(disjointRects.Disjoint(waste));
+		wasteMap.GetFreeRectangles().push_back(waste);
+	}
+}
+
+void SkylineBinPack::AddSkylineLevel(int skylineNodeIndex, const Rect &rect)
+{
+	// First track all wasted areas and mark them into the waste map if we're using one.
+	if (useWasteMap)
+		AddWasteMapArea(skylineNodeIndex, rect.width, rect.y);
+
+	SkylineNode newNode;
+	newNode.x = rect.x;
+	newNode.y = rect.y + rect.height;
+	newNode.width = rect.width;
+	skyLine.insert(skyLine.begin() + skylineNodeIndex, newNode);
+
+	assert(newNode.x + newNode.width <= binWidth);
+	assert(newNode.y <= binHeight);
+
+	// Cut the segments under the new one off, they are all covered but the last.
+	size_t i = skylineNodeIndex + 1;
+	size_t end = i;
+	while(end < skyLine.size() && skyLine[end].x + skyLine[end].width <= newNode.x + newNode.width)
+		++end;
+	if (end < skyLine.size() && skyLine[end].x < newNode.x + newNode.width)
+	{
+		int shrink = newNode.x + newNode.width - skyLine[end].x;
+		skyLine[end].x += shrink;
+		skyLine[end].width -= shrink;
+	}
+	skyLine.erase(skyLine.begin() + i, skyLine.begin() + end);
+
+	MergeSkylines(max(skylineNodeIndex - 1, 0), skylineNodeIndex + 1);
+}
+
+void SkylineBinPack::MergeSkylines(int first, int last)
+{
+	last = min(last, (int)skyLine.size() - 1);
+	for(int i = last; i > first; --i)
+		if (skyLine[i - 1].y == skyLine[i].y)
+		{
+			skyLine[i - 1].width += skyLine[i].width;
+			skyLine.erase(skyLine.begin() + i);
+		}
+}
+
+Rect SkylineBinPack::InsertBottomLeft(int width, int height, bool rot)
+{
+	int bestHeight;
+	int bestWidth;
+	int bestIndex;
+	Rect newNode = FindPositionForNewNodeBottomLeft(width, height, rot, bestHeight, bestWidth, bestIndex);
+
+	if (bestIndex != -1)
+	{
+		debug_assert(disjointRects.Disjoint(newNode));
+
+		// Perform the actual packing.
+		AddSkylineLevel(bestIndex, newNode);
+
+		usedSurfaceArea += width * height;
+#ifdef _DEBUG
+		disjointRects.Add(newNode);
+#endif
+	}
+	else
+		memset(&newNode, 0, sizeof(Rect));
+
+	return newNode;
+}
+
+Rect SkylineBinPack::FindPositionForNewNodeBottomLeft(int width, int height, bool rot, int &bestHeight, int &bestWidth, int &bestIndex) const
+{
+	bestHeight = std::numeric_limits<int>::max();
+	bestIndex = -1;
+	// Used to break ties if there are nodes at the same level. Then pick the narrowest one.
+	bestWidth = std::numeric_limits<int>::max();
+	Rect newNode;
+	memset(&newNode, 0, sizeof(newNode));
+	for(size_t i = 0; i < skyLine.size(); ++i)
+	{
+		int y;
+		if (RectangleFits(i, width, height, y))
+		{
+			if (y + height < bestHeight || (y + height == bestHeight && skyLine[i].width < bestWidth))
+			{
+				bestHeight = y + height;
+				bestIndex = i;
+				bestWidth = skyLine[i].width;
+				newNode.x = skyLine[i].x;
+				newNode.y = y;
+				newNode.width = width;
+				newNode.height = height;
+				debug_assert(disjointRects.Disjoint(newNode));
+			}
+		}
+		if (rot && width != height && RectangleFits(i, height, width, y))
+		{
+			if (y + width < bestHeight || (y + width == bestHeight && skyLine[i].width < bestWidth))
+			{
+				bestHeight = y + width;
+				bestIndex = i;
+				bestWidth = skyLine[i].width;
+				newNode.x = skyLine[i].x;
+				newNode.y = y;
+				newNode.width = height;
+				newNode.height = width;
+				debug_assert(disjointRects.Disjoint(newNode));
+			}
+		}
+	}
+
+	return newNode;
+}
+
+Rect SkylineBinPack::InsertMinWaste(int width, int height, bool rot)
+{
+	int bestHeight;
+	int bestWastedArea;
+	int bestIndex;
+	Rect newNode = FindPositionForNewNodeMinWaste(width, height, rot, bestHeight, bestWastedArea, bestIndex);
+
+	if (bestIndex != -1)
+	{
+		debug_assert(disjointRects.Disjoint(newNode));
+
+		// Perform the actual packing.
+		AddSkylineLevel(bestIndex, newNode);
+
+		usedSurfaceArea += width * height;
+#ifdef _DEBUG
+		disjointRects.Add(newNode);
+#endif
+	}
+	else
+		memset(&newNode, 0, sizeof(newNode));
+
+	return newNode;
+}
+
+Rect SkylineBinPack::FindPositionForNewNodeMinWaste(int width, int height, bool rot, int &bestHeight, int &bestWastedArea, int &bestIndex) const
+{
+	bestHeight = std::numeric_limits<int>::max();
+	bestWastedArea = std::numeric_limits<int>::max();
+	bestIndex = -1;
+	Rect newNode;
+	memset(&newNode, 0, sizeof(newNode));
+	for(size_t i = 0; i < skyLine.size(); ++i)
+	{
+		int y;
+		int wastedArea;
+
+		if (RectangleFits(i, width, height, y, wastedArea))
+		{
+			if (wastedArea < bestWastedArea || (wastedArea == bestWastedArea && y + height < bestHeight))
+			{
+				bestHeight = y + height;
+				bestWastedArea = wastedArea;
+				bestIndex = i;
+				newNode.x = skyLine[i].x;
+				newNode.y = y;
+				newNode.width = width;
+				newNode.height = height;
+				debug_assert(disjointRects.Disjoint(newNode));
+			}
+		}
+		if (rot && width != height && RectangleFits(i, height, width, y, wastedArea))
+		{
+			if (wastedArea < bestWastedArea || (wastedArea == bestWastedArea && y + width < bestHeight))
+			{
+				bestHeight = y + width;
+				bestWastedArea = wastedArea;
+				bestIndex = i;
+				newNode.x = skyLine[i].x;
+				newNode.y = y;
+				newNode.width = height;
+				newNode.height = width;
+				debug_assert(disjointRects.Disjoint(newNode));
+			}
+		}
+	}
+
+	return newNode;
+}
+
+/// Computes the ratio of used surface area.
+float SkylineBinPack::Occupancy() const
+{
+	return (float)usedSurfaceArea / (binWidth * binHeight);
+}
+
+}
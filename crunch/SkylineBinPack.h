@@ -0,0 +1,102 @@
+/** @file SkylineBinPack.h
+	@author Jukka Jylnki
+
+	@brief Implements different bin packer algorithms that use the SKYLINE data structure.
+
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+
+#include "Rect.h"
+#include "GuillotineBinPack.h"
+
+namespace rbp {
+
+/** Implements bin packing algorithms that use the SKYLINE data structure to store the bin contents. Uses
+	GuillotineBinPack as the waste map. */
+class SkylineBinPack
+{
+public:
+	/// Instantiates a bin of size (0,0). Call Init to create a new bin.
+	SkylineBinPack();
+
+	/// Instantiates a bin of the given size.
+	SkylineBinPack(int binWidth, int binHeight, bool useWasteMap);
+
+	/// (Re)initializes the packer to an empty bin of width x height units. Call whenever
+	/// you need to restart with a new bin.
+	void Init(int binWidth, int binHeight, bool useWasteMap);
+
+	/// Defines the different heuristic rules that can be used to decide how to make the rectangle placements.
+	enum LevelChoiceHeuristic
+	{
+		LevelBottomLeft, ///< -BL: Places the rectangle where its top ends up the lowest.
+		LevelMinWasteFit ///< -MW: Places the rectangle where it leaves the least space wasted under it.
+	};
+
+	/// Inserts a single rectangle into the bin, possibly rotated. Placements on the skyline cost time proportional
+	/// to the number of segments in it, and the waste map is only searched when the rectangle doesn't fit there.
+	Rect Insert(int width, int height, bool rot, LevelChoiceHeuristic method);
+
+	/// Computes the ratio of used surface area to the total bin area.
+	float Occupancy() const;
+
+private:
+	int binWidth;
+	int binHeight;
+
+#ifdef _DEBUG
+	DisjointRectCollection disjointRects;
+#endif
+
+	/// Represents a single level (a horizontal line) of the skyline/horizon/envelope.
+	struct SkylineNode
+	{
+		/// The starting x-coordinate (leftmost).
+		int x;
+
+		/// The y-coordinate of the skyline level line.
+		int y;
+
+		/// The line width. The ending coordinate (inclusive) will be x+width-1.
+		int width;
+	};
+
+	/// The segments of the skyline from left to right. They cover the whole width of the bin.
+	std::vector<SkylineNode> skyLine;
+
+	unsigned long usedSurfaceArea;
+
+	/// If true, we use the GuillotineBinPack structure to recover wasted areas into a waste map, which
+	/// rectangles that don't fit on the skyline anymore are packed into.
+	bool useWasteMap;
+	GuillotineBinPack wasteMap;
+
+	Rect InsertBottomLeft(int width, int height, bool rot);
+	Rect InsertMinWaste(int width, int height, bool rot);
+
+	Rect FindPositionForNewNodeMinWaste(int width, int height, bool rot, int &bestHeight, int &bestWastedArea, int &bestIndex) const;
+	Rect FindPositionForNewNodeBottomLeft(int width, int height, bool rot, int &bestHeight, int &bestWidth, int &bestIndex) const;
+
+	/// @return True if a rectangle of the given size fits on the skyline starting from the given segment.
+	/// @param y [out] The height the rectangle would be placed at, the top of the highest segment under it.
+	bool RectangleFits(int skylineNodeIndex, int width, int height, int &y) const;
+	bool RectangleFits(int skylineNodeIndex, int width, int height, int &y, int &wastedArea) const;
+
+	/// @return The area left uncovered between the skyline and a rectangle placed at the given segment and height.
+	int ComputeWastedArea(int skylineNodeIndex, int width, int y) const;
+
+	/// Adds the areas a rectangle placed at the given segment and height leaves uncovered to the waste map.
+	void AddWasteMapArea(int skylineNodeIndex, int width, int y);
+
+	/// Raises the skyline under the given rectangle to its top.
+	void AddSkylineLevel(int skylineNodeIndex, const Rect &rect);
+
+	/// Merges neighbouring skyline nodes that are at the same level. Only the nodes from first to last are
+	/// looked at, since the rest of the skyline was merged after the previous placement.
+	void MergeSkylines(int first, int last);
+};
+
+}
@@ -0,0 +1,218 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+
+#include "arena.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+
+//Each allocation is prefixed with its size, which also keeps the pointers
+//handed out 16 byte aligned for the SIMD pixel code
+static const size_t headerSize = 16;
+
+static size_t AlignSize(size_t size)
+{
+    return (size + 15) & ~static_cast<size_t>(15);
+}
+
+Arena::Arena(size_t blockSize)
+: current(0), blockSize(blockSize), live(0), last(nullptr)
+{
+    
+}
+
+Arena::~Arena()
+{
+    for (auto& block : blocks)
+        free(block.data);
+}
+
+void* Arena::Alloc(size_t size)
+{
+    size_t need = headerSize + AlignSize(size);
+    
+    //Bump into the first block with enough room left, or add a new one
+    while (current < blocks.size() && blocks[current].size - blocks[current].used < need)
+        ++current;
+    if (current == blocks.size())
+    {
+        Block block;
+        block.size = max(blockSize, need);
+        block.used = 0;
+        block.data = reinterpret_cast<char*>(malloc(block.size));
+        if (block.data == nullptr)
+            return nullptr;
+        blocks.push_back(block);
+    }
+    Block& block = blocks[current];
+    char* ptr = block.data + block.used + headerSize;
+    block.used += need;
+    *reinterpret_cast<size_t*>(ptr - headerSize) = size;
+    last = ptr;
+    ++live;
+    return ptr;
+}
+
+void* Arena::Realloc(void* ptr, size_t size)
+{
+    if (ptr == nullptr)
+        return Alloc(size);
+    size_t& oldSize = *reinterpret_cast<size_t*>(reinterpret_cast<char*>(ptr) - headerSize);
+    
+    //The newest allocation can grow or shrink in place if its block has room
+    if (ptr == last)
+    {
+        Block& block = blocks[current];
+        size_t start = static_cast<size_t>(last - block.data);
+        if (start + AlignSize(size) <= block.size)
+        {
+            block.used = start + AlignSize(size);
+            oldSize = size;
+            return ptr;
+        }
+    }
+    else if (size <= oldSize)
+        return ptr;
+    
+    //Otherwise it has to be copied to the end of the arena
+    void* copy = Alloc(size);
+    if (copy != nullptr)
+    {
+        memcpy(copy, ptr, min(oldSize, size));
+        Free(ptr);
+    }
+    return copy;
+}
+
+void Arena::Free(void* ptr)
+{
+    if (ptr == nullptr)
+        return;
+    
+    //Only the newest allocation can actually be given back
+    if (ptr == last)
+    {
+        blocks[current].used = static_cast<size_t>(last - headerSize - blocks[current].data);
+        last = nullptr;
+    }
+    
+    //Once everything is freed the whole arena can be reused
+    if (--live == 0)
+        Reset();
+}
+
+void Arena::Reset()
+{
+    //If it took more than one block, merge them so next time it all fits in one
+    if (blocks.size() > 1)
+    {
+        size_t total = 0;
+        for (auto& block : blocks)
+        {
+            total += block.size;
+            free(block.data);
+        }
+        blocks.clear();
+        Block block;
+        block.size = total;
+        block.data = reinterpret_cast<char*>(malloc(total));
+        if (block.data != nullptr)
+            blocks.push_back(block);
+    }
+    for (auto& block : blocks)
+        block.used = 0;
+    current = 0;
+    live = 0;
+    last = nullptr;
+}
+
+bool Arena::Owns(const void* ptr) const
+{
+    const char* p = reinterpret_cast<const char*>(ptr);
+    for (auto& block : blocks)
+        if (p >= block.data && p < block.data + block.size)
+            return true;
+    return false;
+}
+
+uint32_t* AllocPixels(size_t count)
+{
+    static Arena arena(16 << 20);
+    static mutex lock;
+    lock_guard<mutex> guard(lock);
+    return reinterpret_cast<uint32_t*>(arena.Alloc(sizeof(uint32_t) * count));
+}
+
+//Decoding a png makes a handful of short-lived allocations that are all
+//freed together, so inside a ScratchScope they come out of the calling
+//thread's scratch arena, which is reused from the start once they're gone.
+//The encoder grows its buffers a lot, so it's better left on the heap
+static thread_local bool scratchActive = false;
+
+static Arena& ScratchArena()
+{
+    static thread_local Arena arena(1 << 20);
+    return arena;
+}
+
+ScratchScope::ScratchScope(bool active)
+: outer(active && !scratchActive)
+{
+    if (active)
+        scratchActive = true;
+}
+
+ScratchScope::~ScratchScope()
+{
+    if (outer)
+        scratchActive = false;
+}
+
+void* lodepng_malloc(size_t size)
+{
+    if (scratchActive)
+        return ScratchArena().Alloc(size);
+    return malloc(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t size)
+{
+    if (ptr == nullptr)
+        return lodepng_malloc(size);
+    if (ScratchArena().Owns(ptr))
+        return ScratchArena().Realloc(ptr, size);
+    return realloc(ptr, size);
+}
+
+void lodepng_free(void* ptr)
+{
+    if (ptr != nullptr && ScratchArena().Owns(ptr))
+        ScratchArena().Free(ptr);
+    else
+        free(ptr);
+}
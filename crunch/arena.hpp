@@ -0,0 +1,82 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+
+#ifndef arena_hpp
+#define arena_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+//A bump allocator. Memory is handed out from a few large blocks, and only
+//the most recent allocation can be grown or given back on its own.
+struct Arena
+{
+    Arena(size_t blockSize);
+    ~Arena();
+    void* Alloc(size_t size);
+    void* Realloc(void* ptr, size_t size);
+    void Free(void* ptr);
+    void Reset();
+    bool Owns(const void* ptr) const;
+private:
+    struct Block
+    {
+        char* data;
+        size_t size;
+        size_t used;
+    };
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+    vector<Block> blocks;
+    size_t current;
+    size_t blockSize;
+    size_t live;
+    char* last;
+};
+
+//Allocates bitmap pixels from a shared arena, they are only freed when the program exits
+uint32_t* AllocPixels(size_t count);
+
+//While an active one of these is alive, lodepng allocates from the calling
+//thread's scratch arena instead of the heap. Anything allocated from the arena
+//can still be freed with lodepng_free after the scope has ended.
+struct ScratchScope
+{
+    ScratchScope(bool active);
+    ~ScratchScope();
+private:
+    bool outer;
+};
+
+void* lodepng_malloc(size_t size);
+void* lodepng_realloc(void* ptr, size_t size);
+void lodepng_free(void* ptr);
+
+#endif
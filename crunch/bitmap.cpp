@@ -26,135 +26,405 @@
 
 #include "bitmap.hpp"
 #include <iostream>
-#define LODEPNG_NO_COMPILE_CPP
 #include "lodepng.h"
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
 #include "hash.hpp"
+#include "pixels.hpp"
+#include "file.hpp"
+#include "arena.hpp"
 
 using namespace std;
 
-Bitmap::Bitmap(const string& file, const string& name, bool premultiply, bool trim)
-: name(name)
+static uint32_t* DecodePng(const string& file, const unsigned char* png, size_t size, bool trusted, bool scratch, int& w, int& h)
 {
-    //Load the png file
+    //Decode the png straight out of wherever it was read to, trusted files don't
+    //have their chunk crcs or zlib adler checked. Images that might be cropped
+    //are decoded into the scratch arena, the rest go on the heap to be kept
+    ScratchScope scope(scratch);
+    LodePNGState state;
+    lodepng_state_init(&state);
+    state.info_raw.colortype = LCT_RGBA;
+    state.info_raw.bitdepth = 8;
+    state.decoder.ignore_crc = trusted ? 1 : 0;
+    state.decoder.zlibsettings.ignore_adler32 = trusted ? 1 : 0;
     unsigned char* pdata;
     unsigned int pw, ph;
-    if (lodepng_decode32_file(&pdata, &pw, &ph, file.data()))
+    unsigned error = lodepng_decode(&pdata, &pw, &ph, &state, png, size);
+    lodepng_state_cleanup(&state);
+    if (error)
     {
         cerr << "failed to load png: " << file << endl;
-        exit(EXIT_FAILURE);
+        return nullptr;
     }
-    int w = static_cast<int>(pw);
-    int h = static_cast<int>(ph);
-    uint32_t* pixels = reinterpret_cast<uint32_t*>(pdata);
+    w = static_cast<int>(pw);
+    h = static_cast<int>(ph);
+    return reinterpret_cast<uint32_t*>(pdata);
+}
+
+static bool OpenPng(const string& file, MappedFile& input)
+{
+    if (!input.Open(file))
+    {
+        cerr << "failed to load png: " << file << endl;
+        return false;
+    }
+    return true;
+}
+
+//Cache files are a fixed header followed by the bitmap's final pixels, so
+//loading one is just a map and a copy
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceSize;
+    uint64_t hashValue;
+    int32_t width;
+    int32_t height;
+    int32_t frameX;
+    int32_t frameY;
+    int32_t frameW;
+    int32_t frameH;
+};
+
+static const char cacheMagic[4] = { 'c', 'r', 'c', 'h' };
+static const uint32_t cacheVersion = 2;
+
+static string CacheFile(const string& cacheDir, const unsigned char* png, size_t size, bool premultiply, bool trim)
+{
+    //Key the cache on the png's contents and every option that changes its pixels
+    size_t key = 0;
+    HashCombine(key, static_cast<size_t>(premultiply));
+    HashCombine(key, static_cast<size_t>(trim));
+    HashData(key, reinterpret_cast<const char*>(png), size);
+    stringstream ss;
+    ss << cacheDir << hex << setfill('0') << setw(sizeof(size_t) * 2) << key << ".px";
+    return ss.str();
+}
+
+static uint32_t* NewPixels(size_t count, bool owned)
+{
+    //Bitmaps that are kept until we exit are packed together in the pixel
+    //arena, ones that are freed again along the way (lazy ones, and every one
+    //in watch mode) get their own allocation
+    if (owned)
+        return reinterpret_cast<uint32_t*>(malloc(sizeof(uint32_t) * count));
+    return AllocPixels(count);
+}
+
+static bool LoadCache(const string& file, size_t sourceSize, CacheHeader& header, uint32_t** pixels, bool owned)
+{
+    MappedFile cache;
+    if (!cache.Open(file) || cache.size < sizeof(CacheHeader))
+        return false;
+    memcpy(&header, cache.data, sizeof(CacheHeader));
+    if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion || header.sourceSize != sourceSize)
+        return false;
+    if (header.width <= 0 || header.height <= 0)
+        return false;
+    size_t size = sizeof(uint32_t) * header.width * header.height;
+    if (cache.size != sizeof(CacheHeader) + size)
+        return false;
     
-    //Premultiply all the pixels by their alpha
-    if (premultiply)
+    //Callers that only want the bitmap's size and hash don't get the pixels
+    if (pixels != nullptr)
     {
-        int count = w * h;
-        uint32_t c,a,r,g,b;
-        float m;
-        for (int i = 0; i < count; ++i)
+        *pixels = NewPixels(static_cast<size_t>(header.width) * header.height, owned);
+        if (*pixels == nullptr)
+            return false;
+        memcpy(*pixels, cache.data + sizeof(CacheHeader), size);
+    }
+    return true;
+}
+
+static void SaveCache(const string& file, size_t sourceSize, const Bitmap* bitmap)
+{
+    CacheHeader header;
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.sourceSize = sourceSize;
+    header.hashValue = bitmap->hashValue;
+    header.width = bitmap->width;
+    header.height = bitmap->height;
+    header.frameX = bitmap->frameX;
+    header.frameY = bitmap->frameY;
+    header.frameW = bitmap->frameW;
+    header.frameH = bitmap->frameH;
+    
+    //Write to a temporary file and move it into place, so a cache file is
+    //never seen half written, even if two threads are saving the same one
+    stringstream ss;
+    ss << file << '.' << hash<thread::id>()(this_thread::get_id());
+    string temp = ss.str();
+    {
+        ofstream stream(temp, ios::binary);
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+        stream.write(reinterpret_cast<const char*>(bitmap->data), sizeof(uint32_t) * bitmap->width * bitmap->height);
+        if (stream)
         {
-			c = pixels[i];
-			a = c >> 24;
-			m = static_cast<float>(a) / 255.0f;
-			r = static_cast<uint32_t>((c & 0xff) * m);
-			g = static_cast<uint32_t>(((c >> 8) & 0xff) * m);
-			b = static_cast<uint32_t>(((c >> 16) & 0xff) * m);
-			pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
+            stream.close();
+            if (!stream.fail() && RenameFile(temp, file))
+                return;
         }
     }
+    remove(temp.data());
+}
+
+static void HashPixels(Bitmap* bitmap)
+{
+    bitmap->hashValue = 0;
+    HashCombine(bitmap->hashValue, static_cast<size_t>(bitmap->width));
+    HashCombine(bitmap->hashValue, static_cast<size_t>(bitmap->height));
+    HashData(bitmap->hashValue, reinterpret_cast<char*>(bitmap->data), sizeof(uint32_t) * bitmap->width * bitmap->height);
+}
+
+static uint32_t* CropPixels(uint32_t* pixels, bool scratch, int w, int h, int x, int y, int width, int height, bool premultiply, bool& owned)
+{
+    //If the decoded image is on the heap and doesn't need cropping, the bitmap
+    //keeps it as it is and frees it itself
+    if (!scratch && width == w && height == h)
+    {
+        if (premultiply)
+            PremultiplyPixels(pixels, static_cast<size_t>(w) * h);
+        owned = true;
+        return pixels;
+    }
     
-    //TODO: skip if all corners contain opaque pixels?
+    uint32_t* data = NewPixels(static_cast<size_t>(width) * height, owned);
+    if (data == nullptr)
+    {
+        cerr << "out of memory" << endl;
+        lodepng_free(pixels);
+        return nullptr;
+    }
     
-    //Get pixel bounds
-    int minX = w - 1;
-    int minY = h - 1;
-    int maxX = 0;
-    int maxY = 0;
-    if (trim)
-    {
-        uint32_t p;
-        for (int y = 0; y < h; ++y)
+    //Copy the rows we keep out of the decoded image, premultiplying them
+    //while they're still in the cache from the copy. If we aren't trimmed
+    //horizontally the rows are contiguous and can be done in one go
+    if (width == w)
+    {
+        memcpy(data, pixels + y * w, sizeof(uint32_t) * width * height);
+        if (premultiply)
+            PremultiplyPixels(data, static_cast<size_t>(width) * height);
+    }
+    else
+    {
+        for (int i = 0; i < height; ++i)
         {
-            for (int x = 0; x < w; ++x)
-            {
-                p = pixels[y * w + x];
-                if ((p >> 24) > 0)
-                {
-                    minX = min(x, minX);
-                    minY = min(y, minY);
-                    maxX = max(x, maxX);
-                    maxY = max(y, maxY);
-                }
-            }
+            uint32_t* row = data + i * width;
+            memcpy(row, pixels + (i + y) * w + x, sizeof(uint32_t) * width);
+            if (premultiply)
+                PremultiplyPixels(row, width);
         }
-        if (maxX < minX || maxY < minY)
+    }
+    
+    //Hand the decoded image back, to the scratch arena if it came from there
+    lodepng_free(pixels);
+    return data;
+}
+
+Bitmap::Bitmap(const string& file, const string& name, bool premultiply, bool trim, bool lazy, bool resident, bool trusted, const string& cacheDir)
+: name(name), file(file), cacheDir(cacheDir), premultiply(premultiply), trim(trim), trusted(trusted), lazy(lazy), ownsData(lazy || resident), failed(false)
+, width(0), height(0), frameX(0), frameY(0), frameW(0), frameH(0), data(nullptr), hashValue(0)
+{
+    MappedFile input;
+    if (OpenPng(file, input))
+        Load(input.data, input.size, lazy);
+    else
+        failed = true;
+}
+
+Bitmap::Bitmap(const string& file, const string& name, const unsigned char* png, size_t size, bool premultiply, bool trim, bool lazy, bool resident, bool trusted, const string& cacheDir)
+: name(name), file(file), cacheDir(cacheDir), premultiply(premultiply), trim(trim), trusted(trusted), lazy(lazy), ownsData(lazy || resident), failed(false)
+, width(0), height(0), frameX(0), frameY(0), frameW(0), frameH(0), data(nullptr), hashValue(0)
+{
+    Load(png, size, lazy);
+}
+
+void Bitmap::Load(const unsigned char* png, size_t sourceSize, bool lazy)
+{
+    //If this png has been loaded before with the same options, skip decoding it
+    string cacheFile;
+    if (!cacheDir.empty())
+    {
+        cacheFile = CacheFile(cacheDir, png, sourceSize, premultiply, trim);
+        CacheHeader header;
+        if (LoadCache(cacheFile, sourceSize, header, lazy ? nullptr : &data, ownsData))
         {
-            minX = 0;
-            minY = 0;
-            maxX = w - 1;
-            maxY = h - 1;
-            cout << "image is completely transparent: " << file << endl;
+            width = header.width;
+            height = header.height;
+            frameX = header.frameX;
+            frameY = header.frameY;
+            frameW = header.frameW;
+            frameH = header.frameH;
+            hashValue = static_cast<size_t>(header.hashValue);
+            return;
         }
     }
-    else
+    
+    //Untrimmed images are never cropped, so they can be decoded to be kept
+    int w, h;
+    uint32_t* pixels = DecodePng(file, png, sourceSize, trusted, trim, w, h);
+    if (pixels == nullptr)
+    {
+        failed = true;
+        return;
+    }
+    
+    //Get pixel bounds
+    int minX = 0;
+    int minY = 0;
+    int maxX = w - 1;
+    int maxY = h - 1;
+    if (trim && !FindOpaqueBounds(pixels, w, h, minX, minY, maxX, maxY))
     {
         minX = 0;
         minY = 0;
         maxX = w - 1;
         maxY = h - 1;
+        cout << "image is completely transparent: " << file << endl;
     }
     
     //Calculate our trimmed size
     width = (maxX - minX) + 1;
     height = (maxY - minY) + 1;
+    frameX = -minX;
+    frameY = -minY;
     frameW = w;
     frameH = h;
-    
-    if (width == w && height == h)
-    {
-        //If we aren't trimmed, use the loaded image data
-        frameX = 0;
-        frameY = 0;
-        data = pixels;
-    }
-    else
+    data = CropPixels(pixels, trim, w, h, minX, minY, width, height, premultiply, ownsData);
+    if (data == nullptr)
     {
-        //Create the trimmed image data
-        data = reinterpret_cast<uint32_t*>(calloc(width * height, sizeof(uint32_t)));
-        frameX = -minX;
-        frameY = -minY;
-        
-        //Copy trimmed pixels over to the trimmed pixel array
-        for (int y = minY; y <= maxY; ++y)
-            for (int x = minX; x <= maxX; ++x)
-                data[(y - minY) * width + (x - minX)] = pixels[y * w + x];
-        
-        //Free the untrimmed pixels
-        free(pixels);
+        failed = true;
+        return;
     }
     
     //Generate a hash for the bitmap
-    hashValue = 0;
-    HashCombine(hashValue, static_cast<size_t>(width));
-    HashCombine(hashValue, static_cast<size_t>(height));
-    HashData(hashValue, reinterpret_cast<char*>(data), sizeof(uint32_t) * width * height);
+    HashPixels(this);
+    
+    if (!cacheFile.empty())
+        SaveCache(cacheFile, sourceSize, this);
+    
+    //Lazy bitmaps only keep what packing needs, the pixels are loaded
+    //again by LoadPixels() when the atlas is written
+    if (lazy)
+        FreePixels();
+}
+
+Bitmap::Bitmap(const string& file, const string& name, bool premultiply, bool trusted, const string& cacheDir)
+: name(name), file(file), cacheDir(cacheDir), premultiply(premultiply), trim(false), trusted(trusted), lazy(true), ownsData(true), failed(false)
+, width(0), height(0), frameX(0), frameY(0), frameW(0), frameH(0), data(nullptr), hashValue(0)
+{
+    //Only read the size out of the png header, the pixels get decoded
+    //by LoadPixels() once we know where they go in the atlas
+    unsigned int pw, ph;
+    LodePNGState state;
+    lodepng_state_init(&state);
+    MappedFile input;
+    failed = !OpenPng(file, input);
+    if (!failed && lodepng_inspect(&pw, &ph, &state, input.data, input.size))
+    {
+        cerr << "failed to load png: " << file << endl;
+        failed = true;
+    }
+    lodepng_state_cleanup(&state);
+    if (failed)
+        return;
+    width = frameW = static_cast<int>(pw);
+    height = frameH = static_cast<int>(ph);
+}
+
+Bitmap::Bitmap(const LayoutSprite& sprite, bool premultiply, bool trim, bool trusted, const string& cacheDir)
+: name(sprite.name), file(sprite.file), cacheDir(cacheDir), premultiply(premultiply), trim(trim), trusted(trusted), lazy(true), ownsData(true), failed(false)
+, width(sprite.width), height(sprite.height), frameX(sprite.frameX), frameY(sprite.frameY), frameW(sprite.frameW), frameH(sprite.frameH)
+, data(nullptr), hashValue(static_cast<size_t>(sprite.hashValue))
+{
+    //Sprites carried over from the last build know everything but their
+    //pixels, which LoadPixels() gets if their page has to be written again
 }
 
 Bitmap::Bitmap(int width, int height)
-: width(width), height(height)
+: premultiply(false), trim(false), trusted(false), lazy(false), ownsData(true), failed(false), width(width), height(height)
 {
     data = reinterpret_cast<uint32_t*>(calloc(width * height, sizeof(uint32_t)));
 }
 
 Bitmap::~Bitmap()
 {
-    free(data);
+    if (ownsData)
+        free(data);
 }
 
-void Bitmap::SaveAs(const string& file)
+bool Bitmap::LoadPixels()
+{
+    MappedFile input;
+    if (!OpenPng(file, input))
+    {
+        failed = true;
+        return false;
+    }
+    size_t sourceSize = input.size;
+    
+    string cacheFile;
+    if (!cacheDir.empty())
+    {
+        cacheFile = CacheFile(cacheDir, input.data, input.size, premultiply, trim);
+        CacheHeader header;
+        if (LoadCache(cacheFile, sourceSize, header, &data, ownsData))
+        {
+            if (header.width != width || header.height != height || header.frameX != frameX || header.frameY != frameY)
+            {
+                cerr << "png changed while packing: " << file << endl;
+                FreePixels();
+                failed = true;
+                return false;
+            }
+            return true;
+        }
+    }
+    
+    int w, h;
+    bool crop = width != frameW || height != frameH;
+    uint32_t* pixels = DecodePng(file, input.data, input.size, trusted, crop, w, h);
+    input.Close();
+    if (pixels != nullptr && (w != frameW || h != frameH))
+    {
+        cerr << "png changed while packing: " << file << endl;
+        lodepng_free(pixels);
+        pixels = nullptr;
+    }
+    if (pixels != nullptr)
+        data = CropPixels(pixels, crop, w, h, -frameX, -frameY, width, height, premultiply, ownsData);
+    if (data == nullptr)
+    {
+        failed = true;
+        return false;
+    }
+    
+    //Bitmaps that were only header scanned don't have a hash yet, and the
+    //cache needs one for when they're loaded with --unique later
+    if (!cacheFile.empty())
+    {
+        HashPixels(this);
+        SaveCache(cacheFile, sourceSize, this);
+    }
+    return true;
+}
+
+void Bitmap::FreePixels()
+{
+    if (ownsData)
+        free(data);
+    data = nullptr;
+}
+
+bool Bitmap::SaveAs(const string& file)
 {
     unsigned char* pdata = reinterpret_cast<unsigned char*>(data);
     unsigned int pw = static_cast<unsigned int>(width);
@@ -162,8 +432,9 @@ void Bitmap::SaveAs(const string& file)
     if (lodepng_encode32_file(file.data(), pdata, pw, ph))
     {
         cout << "failed to save png: " << file << endl;
-        exit(EXIT_FAILURE);
+        return false;
     }
+    return true;
 }
 
 void Bitmap::CopyPixels(const Bitmap* src, int tx, int ty)
@@ -181,9 +452,26 @@ void Bitmap::CopyPixelsRot(const Bitmap* src, int tx, int ty)
             data[(ty + y) * width + (tx + x)] = src->data[(r - x) * src->width + y];
 }
 
-bool Bitmap::Equals(const Bitmap* other) const
+bool Bitmap::Equals(Bitmap* other)
 {
-    if (width == other->width && height == other->height)
+    if (width != other->width || height != other->height)
+        return false;
+    
+    //Bitmaps that keep their pixels are compared as they are
+    if (!lazy && !other->lazy)
         return memcmp(data, other->data, sizeof(uint32_t) * width * height) == 0;
-    return false;
+    
+    //Lazy ones have to load their pixels again to be compared, and --search
+    //compares the same bitmaps from several packers at once
+    static mutex loadMutex;
+    lock_guard<mutex> lock(loadMutex);
+    bool load = data == nullptr;
+    bool loadOther = other->data == nullptr;
+    bool equal = (!load || LoadPixels()) && (!loadOther || other->LoadPixels());
+    equal = equal && memcmp(data, other->data, sizeof(uint32_t) * width * height) == 0;
+    if (load)
+        FreePixels();
+    if (loadOther)
+        other->FreePixels();
+    return equal;
 }
@@ -30,12 +30,23 @@
 #include <string>
 #include <cstdint>
 #include <vector>
+#include "layout.hpp"
 
 using namespace std;
 
 struct Bitmap
 {
     string name;
+    string file;
+    string cacheDir;
+    bool premultiply;
+    bool trim;
+    bool trusted;
+    //Set when the pixels aren't kept after loading, so they have to be loaded again to be used
+    bool lazy;
+    bool ownsData;
+    //Set when the png couldn't be read, or had changed by the time its pixels were loaded again
+    bool failed;
     int width;
     int height;
     int frameX;
@@ -44,13 +55,20 @@ struct Bitmap
     int frameH;
     uint32_t* data;
     size_t hashValue;
-    Bitmap(const string& file, const string& name, bool premultiply, bool trim);
+    Bitmap(const string& file, const string& name, bool premultiply, bool trim, bool lazy, bool resident, bool trusted, const string& cacheDir);
+    Bitmap(const string& file, const string& name, const unsigned char* png, size_t size, bool premultiply, bool trim, bool lazy, bool resident, bool trusted, const string& cacheDir);
+    Bitmap(const string& file, const string& name, bool premultiply, bool trusted, const string& cacheDir);
+    Bitmap(const LayoutSprite& sprite, bool premultiply, bool trim, bool trusted, const string& cacheDir);
     Bitmap(int width, int height);
     ~Bitmap();
-    void SaveAs(const string& file);
+    bool LoadPixels();
+    void FreePixels();
+    bool SaveAs(const string& file);
     void CopyPixels(const Bitmap* src, int tx, int ty);
     void CopyPixelsRot(const Bitmap* src, int tx, int ty);
-    bool Equals(const Bitmap* other) const;
+    bool Equals(Bitmap* other);
+private:
+    void Load(const unsigned char* png, size_t size, bool lazy);
 };
 
 #endif
@@ -0,0 +1,838 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#include "file.hpp"
+#include "str.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#if defined _MSC_VER || defined __MINGW32__
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined __linux__
+#include <cstring>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+//How long in milliseconds nothing has to change for before a watcher
+//stops waiting, long enough for an editor to finish saving a file
+static const int quietTime = 200;
+
+MappedFile::MappedFile()
+: data(nullptr), size(0)
+#if defined _MSC_VER || defined __MINGW32__
+, mapping(nullptr)
+#endif
+{
+    
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#if defined _MSC_VER || defined __MINGW32__
+
+bool MappedFile::Open(const string& file)
+{
+    Close();
+    HANDLE handle = CreateFileW(StrToPath(file).data(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(handle, &fileSize))
+    {
+        CloseHandle(handle);
+        return false;
+    }
+    
+    //Empty files can't be mapped, but they're still valid files
+    size = static_cast<size_t>(fileSize.QuadPart);
+    if (size > 0)
+    {
+        mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr)
+            data = reinterpret_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+    CloseHandle(handle);
+    if (size > 0 && data == nullptr)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+    data = nullptr;
+    mapping = nullptr;
+    size = 0;
+}
+
+bool StatFile(const string& file, FileStat& stat)
+{
+    HANDLE handle = CreateFileW(StrToPath(file).data(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(handle, &info) != 0;
+    CloseHandle(handle);
+    if (!ok)
+        return false;
+    
+    //File times are in 100ns ticks, and the file index stands in for the inode
+    stat.size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    stat.mtime = ((static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime) * 100;
+    stat.inode = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    return true;
+}
+
+static void ReadDir(const string& dir, vector<string>& files, vector<string>& dirs)
+{
+    WIN32_FIND_DATAW data;
+    HANDLE handle = FindFirstFileW(StrToPath(dir + "/*").data(), &data);
+    if (handle == INVALID_HANDLE_VALUE)
+        return;
+    do
+    {
+        string name = PathToStr(data.cFileName);
+        if (name == "." || name == "..")
+            continue;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            dirs.push_back(name);
+        else
+            files.push_back(name);
+    }
+    while (FindNextFileW(handle, &data));
+    FindClose(handle);
+}
+
+FileBatch::FileBatch()
+{
+    
+}
+
+FileBatch::~FileBatch()
+{
+    
+}
+
+bool FileBatch::Read(const vector<string>&)
+{
+    return false;
+}
+
+DirWatcher::DirWatcher()
+{
+    
+}
+
+DirWatcher::~DirWatcher()
+{
+    for (auto handle : handles)
+        FindCloseChangeNotification(handle);
+}
+
+void DirWatcher::Add(const string& dir, bool recursive)
+{
+    HANDLE handle = FindFirstChangeNotificationW(StrToPath(dir).data(), recursive, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    if (handle != INVALID_HANDLE_VALUE && handles.size() < MAXIMUM_WAIT_OBJECTS)
+        handles.push_back(handle);
+    else if (handle != INVALID_HANDLE_VALUE)
+        FindCloseChangeNotification(handle);
+}
+
+bool DirWatcher::Wait(vector<string>&)
+{
+    if (handles.empty())
+    {
+        this_thread::sleep_for(chrono::milliseconds(250));
+        return false;
+    }
+    
+    //Block until something changes, then keep going until it's been quiet
+    //for a moment, since saving a file is often several changes. These
+    //notifications don't say which files they were about
+    DWORD count = static_cast<DWORD>(handles.size());
+    DWORD timeout = INFINITE;
+    while (true)
+    {
+        DWORD result = WaitForMultipleObjects(count, handles.data(), FALSE, timeout);
+        if (result >= WAIT_OBJECT_0 + count)
+            break;
+        FindNextChangeNotification(handles[result - WAIT_OBJECT_0]);
+        timeout = quietTime;
+    }
+    return false;
+}
+
+bool MakeDir(const string& dir)
+{
+    return CreateDirectoryW(StrToPath(dir).data(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+bool RenameFile(const string& from, const string& to)
+{
+    return MoveFileExW(StrToPath(from).data(), StrToPath(to).data(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+#else
+
+bool MappedFile::Open(const string& file)
+{
+    Close();
+    int fd = open(file.data(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    
+    //Empty files can't be mapped, but they're still valid files
+    size = static_cast<size_t>(st.st_size);
+    if (size > 0)
+    {
+        void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED)
+            data = reinterpret_cast<const unsigned char*>(ptr);
+    }
+    close(fd);
+    if (size > 0 && data == nullptr)
+    {
+        size = 0;
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data != nullptr)
+        munmap(const_cast<unsigned char*>(data), size);
+    data = nullptr;
+    size = 0;
+}
+
+bool StatFile(const string& file, FileStat& stat)
+{
+    struct stat st;
+    if (::stat(file.data(), &st) != 0)
+        return false;
+    stat.size = static_cast<uint64_t>(st.st_size);
+#if defined __APPLE__
+    stat.mtime = static_cast<uint64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    stat.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    stat.inode = static_cast<uint64_t>(st.st_ino);
+    return true;
+}
+
+static void ReadDir(const string& dir, vector<string>& files, vector<string>& dirs)
+{
+    DIR* handle = opendir(dir.data());
+    if (handle == nullptr)
+        return;
+    while (dirent* entry = readdir(handle))
+    {
+        string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        
+        //Most file systems say what an entry is while listing it, only links
+        //and the ones that don't need a stat to tell
+        bool isDir = false;
+#if defined DT_DIR
+        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
+            isDir = entry->d_type == DT_DIR;
+        else
+#endif
+        {
+            struct stat st;
+            isDir = ::stat((dir + "/" + name).data(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (isDir)
+            dirs.push_back(name);
+        else
+            files.push_back(name);
+    }
+    closedir(handle);
+}
+
+static bool ReadWhole(const string& file, vector<unsigned char>& contents)
+{
+    int fd = open(file.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    contents.resize(ok ? static_cast<size_t>(st.st_size) : 0);
+    size_t done = 0;
+    while (ok && done < contents.size())
+    {
+        ssize_t size = pread(fd, contents.data() + done, contents.size() - done, static_cast<off_t>(done));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            break;
+        done += static_cast<size_t>(size);
+    }
+    contents.resize(done);
+    close(fd);
+    return ok;
+}
+
+#if defined __linux__
+
+//A submission and completion queue shared with the kernel, driven with raw
+//system calls since liburing isn't something we can count on being installed
+struct Ring
+{
+    int fd;
+    unsigned entries;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+};
+
+static void CloseRing(Ring* ring)
+{
+    if (ring->sqes != nullptr)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != nullptr && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != nullptr)
+        munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    delete ring;
+}
+
+static Ring* OpenRing(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0)
+        return nullptr;
+    Ring* ring = new Ring();
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    
+    //Kernels without the operations we need (older than 5.6) get the fallback
+    const unsigned ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+    size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    vector<unsigned char> probeData(probeSize, 0);
+    auto probe = reinterpret_cast<io_uring_probe*>(probeData.data());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+        CloseRing(ring);
+        return nullptr;
+    }
+    for (auto op : ops)
+    {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            CloseRing(ring);
+            return nullptr;
+        }
+    }
+    
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqRingSize = ring->cqRingSize = max(ring->sqRingSize, ring->cqRingSize);
+    void* sq = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        CloseRing(ring);
+        return nullptr;
+    }
+    ring->sqRing = sq;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = sq;
+    else
+    {
+        void* cq = mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            CloseRing(ring);
+            return nullptr;
+        }
+        ring->cqRing = cq;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        CloseRing(ring);
+        return nullptr;
+    }
+    ring->sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+    
+    auto sqBase = reinterpret_cast<char*>(ring->sqRing);
+    auto cqBase = reinterpret_cast<char*>(ring->cqRing);
+    ring->sqHead = reinterpret_cast<unsigned*>(sqBase + params.sq_off.head);
+    ring->sqTail = reinterpret_cast<unsigned*>(sqBase + params.sq_off.tail);
+    ring->sqMask = reinterpret_cast<unsigned*>(sqBase + params.sq_off.ring_mask);
+    ring->sqArray = reinterpret_cast<unsigned*>(sqBase + params.sq_off.array);
+    ring->cqHead = reinterpret_cast<unsigned*>(cqBase + params.cq_off.head);
+    ring->cqTail = reinterpret_cast<unsigned*>(cqBase + params.cq_off.tail);
+    ring->cqMask = reinterpret_cast<unsigned*>(cqBase + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cqBase + params.cq_off.cqes);
+    return ring;
+}
+
+//Runs all the operations, keeping the ring as full as it will go, and puts
+//each one's result in the slot given by its user_data. Operations that never
+//ran are left at -ECANCELED. If the ring fails, everything the kernel already
+//took is waited for before returning false, so none of it can still write into
+//memory the caller frees, but the ring shouldn't be used again after that
+static bool RunRing(Ring* ring, const vector<io_uring_sqe>& ops, vector<int>& results)
+{
+    results.assign(ops.size(), -ECANCELED);
+    size_t next = 0;
+    unsigned inFlight = 0;
+    unsigned unsubmitted = 0;
+    bool failed = false;
+    while (inFlight > 0 || (!failed && next < ops.size()))
+    {
+        if (!failed)
+        {
+            unsigned tail = *ring->sqTail;
+            while (next < ops.size() && inFlight < ring->entries)
+            {
+                unsigned index = tail & *ring->sqMask;
+                ring->sqes[index] = ops[next++];
+                ring->sqArray[index] = index;
+                ++tail;
+                ++inFlight;
+                ++unsubmitted;
+            }
+            __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+        }
+        
+        int submitted = static_cast<int>(syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (submitted >= 0)
+            unsubmitted -= static_cast<unsigned>(submitted);
+        else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            //Waiting on what's left failed too, there's nothing more we can do
+            if (failed)
+                break;
+            
+            //Take back whatever the kernel hasn't picked up yet so it never
+            //runs, then just wait for the rest to finish
+            failed = true;
+            unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+            unsigned tail = *ring->sqTail;
+            __atomic_store_n(ring->sqTail, head, __ATOMIC_RELEASE);
+            inFlight -= tail - head;
+            unsubmitted = 0;
+        }
+        
+        //Interrupted or short on resources still reaps what's done before trying again
+        unsigned head = *ring->cqHead;
+        unsigned cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != cqTail; ++head)
+        {
+            auto& cqe = ring->cqes[head & *ring->cqMask];
+            results[static_cast<size_t>(cqe.user_data)] = cqe.res;
+            --inFlight;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return !failed;
+}
+
+FileBatch::FileBatch()
+: ring(OpenRing(256))
+{
+    
+}
+
+FileBatch::~FileBatch()
+{
+    if (ring != nullptr)
+        CloseRing(ring);
+}
+
+bool FileBatch::Read(const vector<string>& files)
+{
+    contents.assign(files.size(), vector<unsigned char>());
+    loaded.assign(files.size(), false);
+    if (ring == nullptr)
+    {
+        for (size_t i = 0; i < files.size(); ++i)
+            loaded[i] = ReadWhole(files[i], contents[i]);
+        return true;
+    }
+    
+    //Open every file first
+    vector<io_uring_sqe> ops(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        auto& openOp = ops[i];
+        memset(&openOp, 0, sizeof(openOp));
+        openOp.opcode = IORING_OP_OPENAT;
+        openOp.fd = AT_FDCWD;
+        openOp.addr = reinterpret_cast<uint64_t>(files[i].data());
+        openOp.open_flags = O_RDONLY | O_CLOEXEC;
+        openOp.user_data = i;
+    }
+    vector<int> results;
+    bool ok = RunRing(ring, ops, results);
+    vector<int> fds(files.size(), -1);
+    for (size_t i = 0; i < files.size(); ++i)
+        fds[i] = results[i];
+    
+    //Then size them from the files we actually opened rather than their paths,
+    //which a save by rename can point somewhere else in the meantime
+    vector<struct statx> stats(files.size());
+    vector<size_t> reading;
+    const char* emptyPath = "";
+    if (ok)
+    {
+        ops.clear();
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (fds[i] < 0)
+                continue;
+            io_uring_sqe statOp;
+            memset(&statOp, 0, sizeof(statOp));
+            statOp.opcode = IORING_OP_STATX;
+            statOp.fd = fds[i];
+            statOp.addr = reinterpret_cast<uint64_t>(emptyPath);
+            statOp.len = STATX_SIZE;
+            statOp.off = reinterpret_cast<uint64_t>(&stats[i]);
+            statOp.statx_flags = AT_EMPTY_PATH;
+            statOp.user_data = ops.size();
+            ops.push_back(statOp);
+            reading.push_back(i);
+        }
+        ok = RunRing(ring, ops, results);
+        for (size_t j = 0; ok && j < ops.size(); ++j)
+        {
+            size_t i = reading[j];
+            if (results[j] == 0)
+            {
+                contents[i].resize(static_cast<size_t>(stats[i].stx_size));
+                loaded[i] = true;
+            }
+        }
+    }
+    
+    //Read them all, going around again for any reads that came up short
+    vector<size_t> offsets(files.size(), 0);
+    while (ok)
+    {
+        ops.clear();
+        reading.clear();
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (!loaded[i] || offsets[i] == contents[i].size())
+                continue;
+            io_uring_sqe readOp;
+            memset(&readOp, 0, sizeof(readOp));
+            readOp.opcode = IORING_OP_READ;
+            readOp.fd = fds[i];
+            readOp.addr = reinterpret_cast<uint64_t>(contents[i].data() + offsets[i]);
+            readOp.len = static_cast<uint32_t>(min(contents[i].size() - offsets[i], static_cast<size_t>(1) << 30));
+            readOp.off = offsets[i];
+            readOp.user_data = ops.size();
+            ops.push_back(readOp);
+            reading.push_back(i);
+        }
+        if (ops.empty())
+            break;
+        ok = RunRing(ring, ops, results);
+        for (size_t j = 0; ok && j < ops.size(); ++j)
+        {
+            size_t i = reading[j];
+            int size = results[j];
+            if (size > 0)
+                offsets[i] += static_cast<size_t>(size);
+            else if (size == 0)
+                contents[i].resize(offsets[i]);
+            else
+                loaded[i] = false;
+        }
+    }
+    
+    //If the ring stopped working it's done with all our buffers by now, so
+    //give it up, close the files and read them the slow way
+    if (!ok)
+    {
+        CloseRing(ring);
+        ring = nullptr;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (fds[i] >= 0)
+                close(fds[i]);
+            loaded[i] = ReadWhole(files[i], contents[i]);
+        }
+        return true;
+    }
+    
+    //Otherwise close them all in one go too
+    ops.clear();
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (fds[i] < 0)
+            continue;
+        io_uring_sqe closeOp;
+        memset(&closeOp, 0, sizeof(closeOp));
+        closeOp.opcode = IORING_OP_CLOSE;
+        closeOp.fd = fds[i];
+        closeOp.user_data = ops.size();
+        ops.push_back(closeOp);
+    }
+    if (!RunRing(ring, ops, results))
+    {
+        //Only close the ones that never got to the kernel, closing the others
+        //again could take out a descriptor some other thread just opened
+        CloseRing(ring);
+        ring = nullptr;
+        for (size_t j = 0; j < ops.size(); ++j)
+            if (results[j] == -ECANCELED)
+                close(ops[j].fd);
+    }
+    return true;
+}
+
+DirWatcher::DirWatcher()
+: fd(inotify_init1(IN_CLOEXEC))
+{
+    
+}
+
+DirWatcher::~DirWatcher()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+void DirWatcher::Add(const string& dir, bool recursive)
+{
+    //Writes are watched too, so a file that's still being written keeps the
+    //watcher waiting until it's done
+    if (fd < 0)
+        return;
+    int wd = inotify_add_watch(fd, dir.data(), IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0)
+        return;
+    dirs[wd] = make_pair(dir, recursive);
+    if (!recursive)
+        return;
+    
+    //Every folder needs its own watch, new ones get added as they show up
+    vector<string> files, subdirs;
+    ReadDir(dir, files, subdirs);
+    for (auto& name : subdirs)
+        Add(dir + "/" + name, true);
+}
+
+bool DirWatcher::Wait(vector<string>& changed)
+{
+    if (fd < 0)
+    {
+        this_thread::sleep_for(chrono::milliseconds(250));
+        return false;
+    }
+    
+    //Block until something changes, then keep reading until it's been quiet
+    //for a moment, since saving a file is often several events. Folders that
+    //come or go, or events that were dropped, could mean any file changed
+    alignas(inotify_event) char buffer[4096];
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    int timeout = -1;
+    bool known = true;
+    while (poll(&p, 1, timeout) > 0)
+    {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        if (size <= 0)
+            break;
+        for (char* ptr = buffer; ptr < buffer + size; )
+        {
+            auto event = reinterpret_cast<inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+            auto dir = dirs.find(event->wd);
+            if (event->mask & IN_IGNORED)
+                dirs.erase(event->wd);
+            else if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF))
+                known = false;
+            else if (dir == dirs.end() || event->len == 0)
+                continue;
+            else if (event->mask & IN_ISDIR)
+            {
+                if (dir->second.second && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                    Add(dir->second.first + "/" + event->name, true);
+                known = false;
+            }
+            else
+                changed.push_back(dir->second.first + "/" + event->name);
+        }
+        timeout = quietTime;
+    }
+    return known;
+}
+
+#else
+
+FileBatch::FileBatch()
+{
+    
+}
+
+FileBatch::~FileBatch()
+{
+    
+}
+
+bool FileBatch::Read(const vector<string>& files)
+{
+    contents.assign(files.size(), vector<unsigned char>());
+    loaded.assign(files.size(), false);
+    for (size_t i = 0; i < files.size(); ++i)
+        loaded[i] = ReadWhole(files[i], contents[i]);
+    return true;
+}
+
+DirWatcher::DirWatcher()
+{
+    
+}
+
+DirWatcher::~DirWatcher()
+{
+    
+}
+
+void DirWatcher::Add(const string&, bool)
+{
+    
+}
+
+bool DirWatcher::Wait(vector<string>&)
+{
+    this_thread::sleep_for(chrono::milliseconds(250));
+    return false;
+}
+
+#endif
+
+bool MakeDir(const string& dir)
+{
+    return mkdir(dir.data(), 0777) == 0 || errno == EEXIST;
+}
+
+bool RenameFile(const string& from, const string& to)
+{
+    return rename(from.data(), to.data()) == 0;
+}
+
+#endif
+
+void FindFiles(const string& root, const string& ext, int jobs, vector<FoundFile>& files)
+{
+    //Read the tree a level at a time, with the directories of each level
+    //spread across the workers and their results kept in their own slots
+    vector<FoundFile> result;
+    vector<FoundFile> level(1);
+    level[0].path = root;
+    while (!level.empty())
+    {
+        vector<vector<string>> found(level.size());
+        vector<vector<string>> subdirs(level.size());
+        ParallelFor(level.size(), jobs, [&](size_t i) {
+            ReadDir(level[i].path, found[i], subdirs[i]);
+        });
+        
+        vector<FoundFile> next;
+        for (size_t i = 0; i < level.size(); ++i)
+        {
+            for (auto& name : found[i])
+            {
+                size_t dot = name.rfind('.');
+                if (dot != string::npos && name.compare(dot + 1, string::npos, ext) == 0)
+                {
+                    FoundFile file;
+                    file.path = level[i].path + "/" + name;
+                    file.prefix = level[i].prefix;
+                    result.push_back(file);
+                }
+            }
+            for (auto& name : subdirs[i])
+            {
+                FoundFile dir;
+                dir.path = level[i].path + "/" + name;
+                dir.prefix = level[i].prefix + name + "/";
+                next.push_back(dir);
+            }
+        }
+        level.swap(next);
+    }
+    
+    sort(result.begin(), result.end(), [](const FoundFile& a, const FoundFile& b) {
+        return a.path < b.path;
+    });
+    files.insert(files.end(), result.begin(), result.end());
+}
@@ -0,0 +1,133 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#ifndef file_hpp
+#define file_hpp
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+//A read-only view of a whole file. The file is memory-mapped, so reading it
+//goes straight to the page cache without copying it onto the heap.
+struct MappedFile
+{
+    const unsigned char* data;
+    size_t size;
+    MappedFile();
+    ~MappedFile();
+    bool Open(const string& file);
+    void Close();
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+#if defined _MSC_VER || defined __MINGW32__
+    void* mapping;
+#endif
+};
+
+//The parts of a file's metadata that change whenever its contents do
+struct FileStat
+{
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t inode;
+};
+
+//Reads a file's size, modification time (in nanoseconds) and inode, or the
+//closest equivalents on this platform, without opening its contents
+bool StatFile(const string& file, FileStat& stat);
+
+//A file found under a directory, and the folders between the two joined by slashes
+struct FoundFile
+{
+    string path;
+    string prefix;
+};
+
+//Finds every file with the given extension under a directory and adds them to
+//files. Subdirectories are read on up to jobs threads, and the files are sorted
+//by path so they don't depend on the order the file system lists them in
+void FindFiles(const string& root, const string& ext, int jobs, vector<FoundFile>& files);
+
+//The contents of a batch of files read in one go. On Linux the opens, reads
+//and closes of the whole batch go to io_uring together, so lots of small files
+//don't each pay for several system calls
+struct FileBatch
+{
+    vector<vector<unsigned char>> contents;
+    vector<bool> loaded;
+    FileBatch();
+    ~FileBatch();
+    
+    //Reads the files, any that can't be read are left out of loaded. Returns
+    //false if this platform can't read files in batches, in which case they
+    //should be opened one at a time instead
+    bool Read(const vector<string>& files);
+private:
+    FileBatch(const FileBatch&);
+    FileBatch& operator=(const FileBatch&);
+#if defined __linux__
+    struct Ring* ring;
+#endif
+};
+
+//Waits for files under a set of directories to change. Where the platform
+//can't tell when that happens, waiting just sleeps for a moment instead
+struct DirWatcher
+{
+    DirWatcher();
+    ~DirWatcher();
+    void Add(const string& dir, bool recursive);
+    
+    //Blocks until something changes, then until nothing has for a moment, so
+    //files aren't read while they're still being written. The paths of files
+    //that changed are added to changed, joined to their watched directory
+    //with a slash. Returns false if it can't tell what changed, in which case
+    //anything under the directories might have
+    bool Wait(vector<string>& changed);
+private:
+    DirWatcher(const DirWatcher&);
+    DirWatcher& operator=(const DirWatcher&);
+#if defined _MSC_VER || defined __MINGW32__
+    vector<void*> handles;
+#elif defined __linux__
+    int fd;
+    unordered_map<int, pair<string, bool>> dirs;
+#endif
+};
+
+//Creates a directory, returns true if it was made or already exists
+bool MakeDir(const string& dir);
+
+//Renames a file, replacing the destination if there already is one
+bool RenameFile(const string& from, const string& to);
+
+#endif
@@ -26,11 +26,143 @@
 
 #include "hash.hpp"
 #include <fstream>
-#include <vector>
 #include <iostream>
 #include <sstream>
-#include "tinydir.h"
-#include "str.hpp"
+#include "file.hpp"
+#include "parallel.hpp"
+#include <cstring>
+#include <thread>
+
+static const uint64_t prime1 = 11400714785074694791ULL;
+static const uint64_t prime2 = 14029467366897019727ULL;
+static const uint64_t prime3 = 1609587929392839161ULL;
+static const uint64_t prime4 = 9650029242287828579ULL;
+static const uint64_t prime5 = 2870177450012600261ULL;
+
+static inline uint64_t Rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Read64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t Read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t Round(uint64_t acc, uint64_t input)
+{
+    acc += input * prime2;
+    acc = Rotl(acc, 31);
+    return acc * prime1;
+}
+
+static inline uint64_t MergeRound(uint64_t acc, uint64_t val)
+{
+    acc ^= Round(0, val);
+    return acc * prime1 + prime4;
+}
+
+Hasher::Hasher(uint64_t seed)
+: seed(seed), total(0), buffered(0)
+{
+    acc[0] = seed + prime1 + prime2;
+    acc[1] = seed + prime2;
+    acc[2] = seed;
+    acc[3] = seed - prime1;
+}
+
+void Hasher::Update(const void* data, size_t size)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    total += size;
+    
+    //Top up a partial stripe left over from the last update first
+    if (buffered + size < 32)
+    {
+        if (size > 0)
+            memcpy(buffer + buffered, p, size);
+        buffered += size;
+        return;
+    }
+    if (buffered > 0)
+    {
+        size_t fill = 32 - buffered;
+        memcpy(buffer + buffered, p, fill);
+        for (int i = 0; i < 4; ++i)
+            acc[i] = Round(acc[i], Read64(buffer + i * 8));
+        p += fill;
+        buffered = 0;
+    }
+    
+    //Then run whole 32 byte stripes straight out of the caller's memory
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    for (; end - p >= 32; p += 32)
+    {
+        a0 = Round(a0, Read64(p));
+        a1 = Round(a1, Read64(p + 8));
+        a2 = Round(a2, Read64(p + 16));
+        a3 = Round(a3, Read64(p + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    
+    buffered = static_cast<size_t>(end - p);
+    if (buffered > 0)
+        memcpy(buffer, p, buffered);
+}
+
+uint64_t Hasher::Digest() const
+{
+    uint64_t h;
+    if (total >= 32)
+    {
+        h = Rotl(acc[0], 1) + Rotl(acc[1], 7) + Rotl(acc[2], 12) + Rotl(acc[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = MergeRound(h, acc[i]);
+    }
+    else
+        h = seed + prime5;
+    h += total;
+    
+    //Mix in the tail that didn't make a whole stripe
+    const unsigned char* p = buffer;
+    const unsigned char* end = buffer + buffered;
+    for (; end - p >= 8; p += 8)
+    {
+        h ^= Round(0, Read64(p));
+        h = Rotl(h, 27) * prime1 + prime4;
+    }
+    if (end - p >= 4)
+    {
+        h ^= static_cast<uint64_t>(Read32(p)) * prime1;
+        h = Rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        h ^= (*p) * prime5;
+        h = Rotl(h, 11) * prime1;
+    }
+    
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
 
 template <class T>
 void HashCombine(std::size_t& hash, const T& v)
@@ -45,73 +177,190 @@ void HashCombine(std::size_t& hash, size_t v)
 
 void HashString(size_t& hash, const string& str)
 {
-    HashCombine(hash, str);
+    HashData(hash, str.data(), str.size());
 }
 
-void HashFile(size_t& hash, const string& file)
+bool HashFiles(size_t& hash, const vector<string>& files, int jobs, const Manifest& oldManifest, Manifest& newManifest, const unordered_set<string>* stale, const function<void(size_t, uint64_t, const unsigned char*, size_t)>& hashed)
 {
-    ifstream stream(file, ios::binary | ios::ate);
-    streamsize size = stream.tellg();
-    stream.seekg(0, ios::beg);
-    vector<char> buffer(size + 1);
-    if (!stream.read(buffer.data(), size))
+    //Only files that are new or whose metadata changed since the last run get read
+    vector<ManifestEntry> entries(files.size());
+    //The flags are chars, since vector<bool> packs them into words that
+    //workers can't set at the same time
+    vector<char> found(files.size(), false);
+    vector<char> read(files.size(), false);
+    ParallelFor(files.size(), jobs, [&](size_t i) {
+        auto& entry = entries[i];
+        auto old = oldManifest.find(files[i]);
+        if (stale != nullptr && old != oldManifest.end() && stale->count(files[i]) == 0)
+        {
+            entry = old->second;
+            found[i] = true;
+            return;
+        }
+        if (!StatFile(files[i], entry.stat))
+            return;
+        found[i] = true;
+        if (old != oldManifest.end() && old->second.stat.size == entry.stat.size && old->second.stat.mtime == entry.stat.mtime && old->second.stat.inode == entry.stat.inode)
+            entry.digest = old->second.digest;
+        else
+            read[i] = true;
+    });
+    for (size_t i = 0; i < files.size(); ++i)
     {
-        cerr << "failed to read file: " << file << endl;
-        exit(EXIT_FAILURE);
+        if (!found[i])
+        {
+            cerr << "failed to read file: " << files[i] << endl;
+            return false;
+        }
     }
-    buffer[size] = '\0';
-    string text(buffer.begin(), buffer.end());
-    HashCombine(hash, text);
-}
-
-void HashFiles(size_t& hash, const string& root)
-{
-    static string dot1 = ".";
-    static string dot2 = "..";
     
-    tinydir_dir dir;
-    tinydir_open(&dir, StrToPath(root).data());
+    //Each file is handed on right after it's hashed, while it's still in the
+    //cache, and the bytes are let go of as soon as that's done
+    vector<size_t> changed;
+    for (size_t i = 0; i < files.size(); ++i)
+        if (read[i])
+            changed.push_back(i);
+    vector<char> loaded(files.size(), false);
+    auto hashFile = [&](size_t i, const unsigned char* data, size_t size) {
+        uint64_t digest = DigestData(data, size);
+        entries[i].digest = digest;
+        loaded[i] = true;
+        hashed(i, digest, data, size);
+    };
     
-    while (dir.has_next)
+    //Read them in batches, the next batch is read while the workers hash this
+    //one. Where batches aren't a thing, the files are mapped one at a time
+    const size_t batchSize = 256;
+    FileBatch batch, nextBatch;
+    vector<string> paths, nextPaths;
+    auto gather = [&](size_t first, vector<string>& out) {
+        out.clear();
+        for (size_t j = first; j < changed.size() && j < first + batchSize; ++j)
+            out.push_back(files[changed[j]]);
+    };
+    gather(0, paths);
+    if (batch.Read(paths))
+    {
+        for (size_t first = 0; first < changed.size(); first += batchSize)
+        {
+            gather(first + batchSize, nextPaths);
+            thread reader([&]() {
+                nextBatch.Read(nextPaths);
+            });
+            ParallelFor(paths.size(), jobs, [&](size_t j) {
+                if (!batch.loaded[j])
+                    return;
+                auto& contents = batch.contents[j];
+                hashFile(changed[first + j], contents.data(), contents.size());
+                vector<unsigned char>().swap(contents);
+            });
+            reader.join();
+            batch.contents.swap(nextBatch.contents);
+            batch.loaded.swap(nextBatch.loaded);
+            paths.swap(nextPaths);
+        }
+    }
+    else
     {
-        tinydir_file file;
-        tinydir_readfile(&dir, &file);
-        
-        if (file.is_dir)
+        ParallelFor(changed.size(), jobs, [&](size_t j) {
+            MappedFile input;
+            if (input.Open(files[changed[j]]))
+                hashFile(changed[j], input.data, input.size);
+        });
+    }
+    for (auto i : changed)
+    {
+        if (!loaded[i])
         {
-            if (dot1 != PathToStr(file.name) && dot2 != PathToStr(file.name))
-                HashFiles(hash, PathToStr(file.path));
+            cerr << "failed to read file: " << files[i] << endl;
+            return false;
         }
-        else if (PathToStr(file.extension) == "png")
-            HashFile(hash, PathToStr(file.path));
-        
-        tinydir_next(&dir);
     }
     
-    tinydir_close(&dir);
+    //Add them to the hash in order, so it doesn't depend on which one finished first
+    for (size_t i = 0; i < files.size(); ++i)
+        newManifest[files[i]] = entries[i];
+    HashManifest(hash, files, newManifest);
+    return true;
+}
+
+void HashManifest(size_t& hash, const vector<string>& files, const Manifest& manifest)
+{
+    for (auto& file : files)
+    {
+        //The path is part of the hash too, renaming a file renames its sprite.
+        //The digest is only folded down to a size_t here, it's kept whole everywhere else
+        HashString(hash, file);
+        HashCombine(hash, static_cast<size_t>(manifest.at(file).digest));
+    }
 }
 
 void HashData(size_t& hash, const char* data, size_t size)
 {
-    string str(data, size);
-    HashCombine(hash, str);
+    //The running hash seeds the next one, so hashes chain in order
+    Hasher hasher(hash);
+    hasher.Update(data, size);
+    hash = static_cast<size_t>(hasher.Digest());
+}
+
+uint64_t DigestData(const void* data, size_t size)
+{
+    Hasher hasher(0);
+    hasher.Update(data, size);
+    return hasher.Digest();
 }
 
-bool LoadHash(size_t& hash, const string& file)
+//The manifest is a text file, a header line, the hash of the whole atlas
+//and then a line for each input file. The path goes last so it can have spaces
+static const string manifestHeader = "crunch manifest 1";
+
+bool LoadManifest(size_t& hash, Manifest& manifest, const string& file)
 {
     ifstream stream(file);
-    if (stream)
+    string line;
+    if (!stream || !getline(stream, line) || line != manifestHeader)
+        return false;
+    if (!getline(stream, line))
+        return false;
+    stringstream(line) >> hash;
+    while (getline(stream, line))
     {
-        stringstream ss;
-        ss << stream.rdbuf();
-        ss >> hash;
-        return true;
+        stringstream ss(line);
+        ManifestEntry entry;
+        string path;
+        ss >> entry.stat.size >> entry.stat.mtime >> entry.stat.inode >> entry.digest;
+        ss.get();
+        if (ss && getline(ss, path))
+            manifest[path] = entry;
     }
-    return false;
+    return true;
 }
 
-void SaveHash(size_t hash, const string& file)
+void SaveManifest(size_t hash, const Manifest& manifest, const string& file)
 {
     ofstream stream(file);
-    stream << hash;
+    stream << manifestHeader << '\n';
+    stream << hash << '\n';
+    for (auto& i : manifest)
+    {
+        auto& entry = i.second;
+        stream << entry.stat.size << ' ' << entry.stat.mtime << ' ' << entry.stat.inode << ' ' << entry.digest << ' ' << i.first << '\n';
+    }
+}
+
+bool SameManifest(const Manifest& a, const Manifest& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (auto& i : a)
+    {
+        auto j = b.find(i.first);
+        if (j == b.end())
+            return false;
+        auto& x = i.second;
+        auto& y = j->second;
+        if (x.stat.size != y.stat.size || x.stat.mtime != y.stat.mtime || x.stat.inode != y.stat.inode || x.digest != y.digest)
+            return false;
+    }
+    return true;
 }
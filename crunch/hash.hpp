@@ -28,16 +28,56 @@
 #define hash_hpp
 
 #include <string>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <vector>
+#include "file.hpp"
 using namespace std;
 
+//A streaming 64-bit hash (xxHash64). Data can be fed in pieces of any size
+//straight from where it lives, giving the same result as hashing it all at once.
+struct Hasher
+{
+    Hasher(uint64_t seed);
+    void Update(const void* data, size_t size);
+    uint64_t Digest() const;
+private:
+    uint64_t seed;
+    uint64_t acc[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+};
+
 template <class T>
 void HashCombine(std::size_t& hash, const T& v);
 void HashCombine(std::size_t& hash, size_t v);
 void HashString(size_t& hash, const string& str);
-void HashFile(size_t& hash, const string& file);
-void HashFiles(size_t& hash, const string& root);
+//What the last run knew about each input file, so files whose metadata
+//hasn't changed don't need to be read again to know their contents
+struct ManifestEntry
+{
+    FileStat stat;
+    uint64_t digest;
+};
+typedef unordered_map<string, ManifestEntry> Manifest;
+
+//Hashes the files on top of hash. Files whose metadata matches the old manifest
+//keep their old digest, the rest are read and passed to hashed(index, digest,
+//data, size) on the worker that hashed them, so they can be decoded from the
+//same bytes before those are let go of. If stale is given, only the files in
+//it and ones missing from the old manifest have their metadata checked at all.
+//Returns false if any of the files can't be read
+bool HashFiles(size_t& hash, const vector<string>& files, int jobs, const Manifest& oldManifest, Manifest& newManifest, const unordered_set<string>* stale, const function<void(size_t, uint64_t, const unsigned char*, size_t)>& hashed);
+void HashManifest(size_t& hash, const vector<string>& files, const Manifest& manifest);
 void HashData(size_t& hash, const char* data, size_t size);
-bool LoadHash(size_t& hash, const string& file);
-void SaveHash(size_t hash, const string& file);
+//The full 64-bit digest of a file's contents, kept as is on 32-bit builds too
+uint64_t DigestData(const void* data, size_t size);
+bool LoadManifest(size_t& hash, Manifest& manifest, const string& file);
+void SaveManifest(size_t hash, const Manifest& manifest, const string& file);
+bool SameManifest(const Manifest& a, const Manifest& b);
 
 #endif
@@ -0,0 +1,88 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+
+#include "layout.hpp"
+#include <fstream>
+#include <sstream>
+
+//The layout is a text file: a header line, the options it was packed with,
+//the page count and sizes, then two lines for every sprite. The first has
+//its placement and source with the file path last, the second its name
+static const string layoutHeader = "crunch layout 1";
+
+bool LoadLayout(Layout& layout, const string& file)
+{
+    ifstream stream(file);
+    string line;
+    if (!stream || !getline(stream, line) || line != layoutHeader)
+        return false;
+    if (!getline(stream, layout.options) || !getline(stream, line))
+        return false;
+    
+    size_t count = 0;
+    stringstream(line) >> count;
+    layout.pages.resize(count);
+    for (auto& page : layout.pages)
+    {
+        if (!getline(stream, line))
+            return false;
+        stringstream(line) >> page.width >> page.height;
+    }
+    
+    while (getline(stream, line))
+    {
+        stringstream ss(line);
+        LayoutSprite sprite;
+        ss >> sprite.page >> sprite.x >> sprite.y >> sprite.dupID >> sprite.rot;
+        ss >> sprite.width >> sprite.height >> sprite.frameX >> sprite.frameY >> sprite.frameW >> sprite.frameH;
+        ss >> sprite.hashValue >> sprite.digest;
+        ss.get();
+        if (!ss || !getline(ss, sprite.file) || !getline(stream, sprite.name))
+            return false;
+        if (sprite.page < 0 || static_cast<size_t>(sprite.page) >= layout.pages.size())
+            return false;
+        layout.sprites.push_back(sprite);
+    }
+    return true;
+}
+
+void SaveLayout(const Layout& layout, const string& file)
+{
+    ofstream stream(file);
+    stream << layoutHeader << '\n';
+    stream << layout.options << '\n';
+    stream << layout.pages.size() << '\n';
+    for (auto& page : layout.pages)
+        stream << page.width << ' ' << page.height << '\n';
+    for (auto& sprite : layout.sprites)
+    {
+        stream << sprite.page << ' ' << sprite.x << ' ' << sprite.y << ' ' << sprite.dupID << ' ' << sprite.rot << ' ';
+        stream << sprite.width << ' ' << sprite.height << ' ' << sprite.frameX << ' ' << sprite.frameY << ' ' << sprite.frameW << ' ' << sprite.frameH << ' ';
+        stream << sprite.hashValue << ' ' << sprite.digest << ' ' << sprite.file << '\n';
+        stream << sprite.name << '\n';
+    }
+}
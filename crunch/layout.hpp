@@ -0,0 +1,76 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+
+#ifndef layout_hpp
+#define layout_hpp
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+//Where a sprite was placed in the last build, and what it was made from
+struct LayoutSprite
+{
+    string file;
+    string name;
+    uint64_t digest;
+    uint64_t hashValue;
+    int page;
+    int x;
+    int y;
+    int dupID;
+    bool rot;
+    int width;
+    int height;
+    int frameX;
+    int frameY;
+    int frameW;
+    int frameH;
+};
+
+struct LayoutPage
+{
+    int width;
+    int height;
+};
+
+//The placements of a whole build, saved next to the atlas so the next
+//incremental build can leave unchanged sprites where they are
+struct Layout
+{
+    string options;
+    vector<LayoutPage> pages;
+    vector<LayoutSprite> sprites;
+};
+
+bool LoadLayout(Layout& layout, const string& file);
+void SaveLayout(const Layout& layout, const string& file);
+
+#endif
@@ -42,8 +42,17 @@
     -f  --force             ignore the hash, forcing the packer to repack
     -u  --unique            remove duplicate bitmaps from the atlas
     -r  --rotate            enabled rotating bitmaps 90 degrees clockwise when packing
+    -c  --cache             keeps decoded bitmaps in a folder next to the atlas, so unchanged images aren't decoded again
+    -l  --lazy              frees the pixels of bitmaps after loading them and loads them again when writing the atlas
+    -i  --incremental       keeps unchanged images where they were in the last build and only places the ones that changed
+    -w  --watch             keeps running after packing, and packs again whenever the input files change
+    --trusted               skip checking the crcs of the input pngs, for inputs that are known to be intact
+    --search                packs with every heuristic and sort order at once, and keeps the result with the fewest and smallest pages
+    --batch                 packs whichever remaining bitmap fits best next instead of going biggest first, scoring them on all the --jobs threads
+    --skyline               packs with a skyline instead of maxrects, which is far faster for tens of thousands of small bitmaps but packs less tightly
     -s# --size#             max atlas size (# can be 4096, 2048, 1024, 512, 256, 128, or 64)
     -p# --pad#              padding between images (# can be from 0 to 16)
+    --jobs#                 number of threads used to load and copy bitmaps, and to pack them with --search or --batch (# can be from 1 to 256)
  
  binary format:
     [int16] num_textures (below block is repeated this many times)
@@ -68,12 +77,17 @@
 #include <string>
 #include <vector>
 #include <algorithm>
-#include "tinydir.h"
 #include "bitmap.hpp"
 #include "packer.hpp"
 #include "binary.hpp"
 #include "hash.hpp"
-#include "str.hpp"
+#include "file.hpp"
+#include "parallel.hpp"
+#include "layout.hpp"
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
 
 using namespace std;
 
@@ -88,8 +102,34 @@ static bool optVerbose;
 static bool optForce;
 static bool optUnique;
 static bool optRotate;
+static bool optCache;
+static bool optLazy;
+static bool optIncremental;
+static bool optTrusted;
+static bool optWatch;
+static bool optSearch;
+static bool optBatch;
+static bool optSkyline;
+static int optJobs;
+static vector<vector<FoundFile>> inputFiles;
+static vector<string> bitmapFiles;
+static vector<string> bitmapNames;
+static vector<Bitmap*> hashedBitmaps;
+static string cacheDir;
 static vector<Bitmap*> bitmaps;
 static vector<Packer*> packers;
+static size_t oldHash;
+static Manifest oldManifest;
+static bool hasManifest;
+
+//In watch mode bitmaps stay loaded between builds, along with the digest of
+//the file they were loaded from so changed files get loaded again
+struct ResidentBitmap
+{
+    uint64_t digest;
+    Bitmap* bitmap;
+};
+static unordered_map<string, ResidentBitmap> resident;
 
 static void SplitFileName(const string& path, string* dir, string* name, string* ext)
 {
@@ -127,39 +167,586 @@ static string GetFileName(const string& path)
     return name;
 }
 
-static void LoadBitmap(const string& prefix, const string& path)
+static void FindBitmap(const string& prefix, const string& path)
+{
+    bitmapFiles.push_back(path);
+    bitmapNames.push_back(prefix + GetFileName(path));
+}
+
+static bool IsFileInput(const string& input)
+{
+    return input.rfind('.') != string::npos;
+}
+
+//The folder that gets watched for an input file
+static string WatchedDir(const string& file)
+{
+    string dir;
+    SplitFileName(file, &dir, nullptr, nullptr);
+    if (dir.empty())
+        return ".";
+    if (dir.size() > 1)
+        dir.pop_back();
+    return dir;
+}
+
+static void FindInputs(const vector<string>& inputs)
+{
+    inputFiles.assign(inputs.size(), vector<FoundFile>());
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (IsFileInput(inputs[i]))
+        {
+            FoundFile file;
+            file.path = inputs[i];
+            inputFiles[i].push_back(file);
+        }
+        else
+            FindFiles(inputs[i], "png", optJobs, inputFiles[i]);
+    }
+}
+
+//Applies the paths the watcher saw change to the files found last time, so
+//the input folders don't have to be read again. New pngs go where FindFiles
+//would have sorted them, and ones that are gone are dropped. The inputs that
+//changed are added to stale, the rest are the same as last time
+static void UpdateInputs(const vector<string>& inputs, const unordered_set<string>& changed, unordered_set<string>& stale)
+{
+    for (auto& path : changed)
+    {
+        string name = path.substr(path.rfind('/') + 1);
+        size_t dot = name.rfind('.');
+        if (dot == string::npos || name.compare(dot + 1, string::npos, "png") != 0)
+            continue;
+        for (size_t i = 0; i < inputs.size(); ++i)
+        {
+            if (IsFileInput(inputs[i]))
+            {
+                if (path == WatchedDir(inputs[i]) + "/" + inputs[i].substr(inputs[i].rfind('/') + 1))
+                    stale.insert(inputs[i]);
+                continue;
+            }
+            string root = inputs[i] + "/";
+            if (path.compare(0, root.size(), root) != 0)
+                continue;
+            auto& files = inputFiles[i];
+            auto f = lower_bound(files.begin(), files.end(), path, [](const FoundFile& a, const string& b) {
+                return a.path < b;
+            });
+            bool found = f != files.end() && f->path == path;
+            FileStat stat;
+            if (!StatFile(path, stat))
+            {
+                if (found)
+                    files.erase(f);
+                continue;
+            }
+            if (!found)
+            {
+                FoundFile file;
+                file.path = path;
+                file.prefix = path.substr(root.size(), path.size() - name.size() - root.size());
+                files.insert(f, file);
+            }
+            stale.insert(path);
+        }
+    }
+}
+
+static Bitmap* TakeResident(const string& file, const Manifest& manifest)
+{
+    auto r = resident.find(file);
+    if (r == resident.end())
+        return nullptr;
+    auto m = manifest.find(file);
+    Bitmap* bitmap = r->second.bitmap;
+    if (m == manifest.end() || m->second.digest != r->second.digest)
+    {
+        delete bitmap;
+        bitmap = nullptr;
+    }
+    resident.erase(r);
+    return bitmap;
+}
+
+static void ReleaseBitmap(Bitmap* bitmap, const Manifest& manifest)
+{
+    //In watch mode bitmaps own their pixels, so deleting one frees them, and
+    //ones whose file is still there are kept for the next build
+    auto m = manifest.find(bitmap->file);
+    if (!optWatch || bitmap->failed || m == manifest.end())
+    {
+        delete bitmap;
+        return;
+    }
+    auto r = resident.find(bitmap->file);
+    if (r != resident.end() && r->second.bitmap != bitmap)
+        delete r->second.bitmap;
+    ResidentBitmap& entry = resident[bitmap->file];
+    entry.digest = m->second.digest;
+    entry.bitmap = bitmap;
+}
+
+static Bitmap* NewBitmap(size_t i)
+{
+    //Files that were decoded when they were hashed are taken as they are
+    Bitmap* bitmap = hashedBitmaps[i];
+    hashedBitmaps[i] = nullptr;
+    if (bitmap == nullptr)
+        bitmap = new Bitmap(bitmapFiles[i], bitmapNames[i], optPremultiply, optTrim, optLazy, optWatch, optTrusted, cacheDir);
+    return bitmap;
+}
+
+static void FreeHashedBitmaps()
+{
+    for (auto bitmap : hashedBitmaps)
+        delete bitmap;
+    hashedBitmaps.clear();
+}
+
+//Untrimmed packing only needs the sizes, and without --unique nothing
+//compares pixels, so just scan the png headers and leave decoding for
+//when the atlas is written. Watch mode wants the pixels to stay around
+static bool ScanHeaders()
+{
+    return !optTrim && !optUnique && !optWatch;
+}
+
+static void LoadBitmaps(Manifest& manifest)
+{
+    //Each worker fills its own slot, so the order matches a serial load
+    bitmaps.resize(bitmapFiles.size());
+    for (size_t i = 0; i < bitmapFiles.size(); ++i)
+        bitmaps[i] = TakeResident(bitmapFiles[i], manifest);
+    
+    if (ScanHeaders())
+    {
+        ParallelFor(bitmapFiles.size(), optJobs, [](size_t i) {
+            bitmaps[i] = new Bitmap(bitmapFiles[i], bitmapNames[i], optPremultiply, optTrusted, cacheDir);
+        });
+        return;
+    }
+    
+    vector<size_t> pending;
+    for (size_t i = 0; i < bitmapFiles.size(); ++i)
+    {
+        if (bitmaps[i] == nullptr)
+            swap(bitmaps[i], hashedBitmaps[i]);
+        if (bitmaps[i] == nullptr)
+            pending.push_back(i);
+    }
+    
+    //Read the rest of the pngs in batches, the next batch is read while the
+    //workers decode this one. Anything that couldn't be read is opened on
+    //its own, which reports why
+    const size_t batchSize = 256;
+    FileBatch batch, nextBatch;
+    vector<string> paths, nextPaths;
+    auto gather = [&](size_t first, vector<string>& out) {
+        out.clear();
+        for (size_t j = first; j < pending.size() && j < first + batchSize; ++j)
+            out.push_back(bitmapFiles[pending[j]]);
+    };
+    gather(0, paths);
+    if (!batch.Read(paths))
+    {
+        ParallelFor(pending.size(), optJobs, [&](size_t j) {
+            size_t i = pending[j];
+            bitmaps[i] = new Bitmap(bitmapFiles[i], bitmapNames[i], optPremultiply, optTrim, optLazy, optWatch, optTrusted, cacheDir);
+        });
+        return;
+    }
+    
+    //These files weren't decoded when hashing, mostly because their metadata
+    //hadn't changed, so hash what was actually read to make sure they really hadn't
+    vector<uint64_t> digests(pending.size(), 0);
+    vector<char> hashed(pending.size(), false);
+    for (size_t first = 0; first < pending.size(); first += batchSize)
+    {
+        gather(first + batchSize, nextPaths);
+        thread reader([&]() {
+            nextBatch.Read(nextPaths);
+        });
+        ParallelFor(paths.size(), optJobs, [&](size_t j) {
+            size_t i = pending[first + j];
+            if (batch.loaded[j])
+            {
+                auto& png = batch.contents[j];
+                digests[first + j] = DigestData(png.data(), png.size());
+                hashed[first + j] = true;
+                bitmaps[i] = new Bitmap(bitmapFiles[i], bitmapNames[i], png.data(), png.size(), optPremultiply, optTrim, optLazy, optWatch, optTrusted, cacheDir);
+            }
+            else
+                bitmaps[i] = new Bitmap(bitmapFiles[i], bitmapNames[i], optPremultiply, optTrim, optLazy, optWatch, optTrusted, cacheDir);
+        });
+        reader.join();
+        batch.contents.swap(nextBatch.contents);
+        batch.loaded.swap(nextBatch.loaded);
+        paths.swap(nextPaths);
+    }
+    
+    //A file that changed without its metadata changing gets the digest of
+    //what was packed, and no mtime so the next build reads it again
+    for (size_t j = 0; j < pending.size(); ++j)
+    {
+        auto& entry = manifest[bitmapFiles[pending[j]]];
+        if (hashed[j] && entry.digest != digests[j])
+        {
+            entry.digest = digests[j];
+            entry.stat.mtime = 0;
+        }
+    }
+}
+
+static void FreePackers(const Manifest& manifest)
+{
+    for (auto packer : packers)
+    {
+        for (auto bitmap : packer->bitmaps)
+            ReleaseBitmap(bitmap, manifest);
+        delete packer;
+    }
+    packers.clear();
+}
+
+//Lets go of everything a build had loaded when it fails part way
+static void FreeBuild(const Manifest& manifest)
+{
+    for (auto bitmap : bitmaps)
+        ReleaseBitmap(bitmap, manifest);
+    bitmaps.clear();
+    FreePackers(manifest);
+}
+
+static bool LoadFailed()
+{
+    for (auto bitmap : bitmaps)
+        if (bitmap->failed)
+            return true;
+    for (auto packer : packers)
+        for (auto bitmap : packer->bitmaps)
+            if (bitmap->failed)
+                return true;
+    return false;
+}
+
+//The orders bitmaps can be packed in. Packers take them from the back of the
+//list, so the biggest ones go last
+static bool CompareArea(const Bitmap* a, const Bitmap* b)
+{
+    return (a->width * a->height) < (b->width * b->height);
+}
+
+static bool ComparePerimeter(const Bitmap* a, const Bitmap* b)
+{
+    return (a->width + a->height) < (b->width + b->height);
+}
+
+static bool CompareMaxSide(const Bitmap* a, const Bitmap* b)
+{
+    return max(a->width, a->height) < max(b->width, b->height);
+}
+
+static bool CompareWidth(const Bitmap* a, const Bitmap* b)
+{
+    return a->width < b->width;
+}
+
+static bool CompareHeight(const Bitmap* a, const Bitmap* b)
+{
+    return a->height < b->height;
+}
+
+struct SortOrder
+{
+    const char* name;
+    bool (*compare)(const Bitmap*, const Bitmap*);
+};
+
+static const SortOrder sortOrders[] = {
+    { "area", CompareArea },
+    { "perimeter", ComparePerimeter },
+    { "max side", CompareMaxSide },
+    { "width", CompareWidth },
+    { "height", CompareHeight },
+};
+
+//Packs the bitmaps onto as many pages as it takes. Returns false if one of
+//them doesn't fit on a page by itself, leaving it at the back of bitmaps
+static bool PackPages(vector<Bitmap*>& bitmaps, vector<Packer*>& pages, const PackMethod& method, int jobs, bool verbose, const string& name)
+{
+    while (!bitmaps.empty())
+    {
+        if (verbose)
+            cout << "packing " << bitmaps.size() << " images..." << endl;
+        auto packer = new Packer(optSize, optSize, optPadding, method);
+        if (optBatch)
+            packer->PackBatch(bitmaps, verbose, optUnique, optRotate, jobs);
+        else
+            packer->Pack(bitmaps, verbose, optUnique, optRotate);
+        pages.push_back(packer);
+        if (verbose)
+            cout << "finished packing: " << name << to_string(pages.size() - 1) << " (" << packer->width << " x " << packer->height << ')' << endl;
+        if (packer->bitmaps.empty())
+            return false;
+    }
+    return true;
+}
+
+//The method bitmaps are packed with when not searching
+static PackMethod ChosenMethod()
+{
+    PackMethod method;
+    if (optSkyline)
+        method.engine = PackMethod::Skyline;
+    return method;
+}
+
+static size_t PagesArea(const vector<Packer*>& pages)
+{
+    size_t area = 0;
+    for (auto page : pages)
+        area += static_cast<size_t>(page->width) * page->height;
+    return area;
+}
+
+//Packs the bitmaps with every method and sort order, and keeps the packing
+//with the fewest pages, then the smallest area. Ties go to whichever comes
+//first, so the default packing wins unless something beats it
+static bool SearchPacking(const string& name)
 {
+    auto methods = AllPackMethods();
+    size_t numOrders = sizeof(sortOrders) / sizeof(sortOrders[0]);
+    size_t count = methods.size() * numOrders;
     if (optVerbose)
-        cout << '\t' << PathToStr(path) << endl;
+        cout << "trying " << count << " ways to pack " << bitmaps.size() << " images..." << endl;
+    
+    mutex bestMutex;
+    vector<Packer*> best;
+    size_t bestArea = 0;
+    size_t bestIndex = count;
+    ParallelFor(count, optJobs, [&](size_t i) {
+        vector<Bitmap*> remaining = bitmaps;
+        sort(remaining.begin(), remaining.end(), sortOrders[i % numOrders].compare);
+        vector<Packer*> pages;
+        bool packed = PackPages(remaining, pages, methods[i / numOrders], 1, false, name);
+        size_t area = PagesArea(pages);
+        
+        lock_guard<mutex> lock(bestMutex);
+        if (packed && (bestIndex == count || pages.size() < best.size() ||
+            (pages.size() == best.size() && (area < bestArea || (area == bestArea && i < bestIndex)))))
+        {
+            best.swap(pages);
+            bestArea = area;
+            bestIndex = i;
+        }
+        for (auto page : pages)
+            delete page;
+    });
+    
+    //If nothing fit, pack the usual way so the bitmap that doesn't fit gets reported
+    if (bestIndex == count)
+    {
+        sort(bitmaps.begin(), bitmaps.end(), CompareArea);
+        return PackPages(bitmaps, packers, ChosenMethod(), optJobs, optVerbose, name);
+    }
     
-    bitmaps.push_back(new Bitmap(PathToStr(path), prefix + GetFileName(PathToStr(path)), optPremultiply, optTrim));
+    packers = best;
+    bitmaps.clear();
+    if (optVerbose)
+    {
+        cout << "best packing: " << methods[bestIndex / numOrders].Name() << ", " << sortOrders[bestIndex % numOrders].name << " order" << endl;
+        for (size_t i = 0; i < packers.size(); ++i)
+            cout << "finished packing: " << name << to_string(i) << " (" << packers[i]->width << " x " << packers[i]->height << ')' << endl;
+    }
+    return true;
+}
+
+static string LayoutOptions()
+{
+    //Everything that changes where sprites go or what their pixels are
+    stringstream ss;
+    ss << optSize << ' ' << optPadding << ' ' << optPremultiply << ' ' << optTrim << ' ' << optUnique << ' ' << optRotate;
+    return ss.str();
 }
 
-static void LoadBitmaps(const string& root, const string& prefix)
+static bool PackIncremental(const Layout& layout, const Manifest& manifest, const string& prefix, bool& failed)
 {
-    static string dot1 = ".";
-    static string dot2 = "..";
+    //Sprites whose file is unchanged since the last build stay where they
+    //were, everything else gets loaded and placed again
+    unordered_map<string, size_t> previous;
+    for (size_t i = 0; i < layout.sprites.size(); ++i)
+        previous[layout.sprites[i].file] = i;
+    vector<bool> kept(layout.sprites.size(), false);
+    vector<size_t> keptFiles(layout.sprites.size());
+    vector<size_t> changed;
+    for (size_t i = 0; i < bitmapFiles.size(); ++i)
+    {
+        auto p = previous.find(bitmapFiles[i]);
+        auto m = manifest.find(bitmapFiles[i]);
+        if (p != previous.end() && m != manifest.end() && !kept[p->second])
+        {
+            auto& sprite = layout.sprites[p->second];
+            if (sprite.digest == m->second.digest && sprite.name == bitmapNames[i])
+            {
+                kept[p->second] = true;
+                keptFiles[p->second] = i;
+                continue;
+            }
+        }
+        changed.push_back(i);
+    }
     
-    tinydir_dir dir;
-    tinydir_open(&dir, StrToPath(root).data());
+    //Duplicates point at an earlier sprite on their page. If that one isn't
+    //staying, the duplicate is placed again with the changed bitmaps, where
+    //it's deduplicated against them or gets a spot of its own
+    vector<vector<size_t>> pageSprites(layout.pages.size());
+    for (size_t i = 0; i < layout.sprites.size(); ++i)
+    {
+        auto& sprite = layout.sprites[i];
+        auto& onPage = pageSprites[sprite.page];
+        if (kept[i] && sprite.dupID >= 0 && (static_cast<size_t>(sprite.dupID) >= onPage.size() || !kept[onPage[sprite.dupID]]))
+        {
+            kept[i] = false;
+            changed.push_back(keptFiles[i]);
+        }
+        onPage.push_back(i);
+    }
     
-    while (dir.has_next)
+    //Rebuild the pages out of the sprites that are staying, any page that
+    //lost a sprite has to be written again
+    for (size_t i = 0; i < layout.pages.size(); ++i)
     {
-        tinydir_file file;
-        tinydir_readfile(&dir, &file);
-        
-        if (file.is_dir)
+        packers.push_back(new Packer(optSize, optSize, optPadding));
+        packers.back()->dirty = false;
+    }
+    vector<vector<int>> remap(layout.pages.size());
+    for (size_t i = 0; i < layout.sprites.size(); ++i)
+    {
+        auto& sprite = layout.sprites[i];
+        auto packer = packers[sprite.page];
+        auto& pageRemap = remap[sprite.page];
+        if (!kept[i])
         {
-            if (dot1 != PathToStr(file.name) && dot2 != PathToStr(file.name))
-                LoadBitmaps(PathToStr(file.path), prefix + PathToStr(file.name) + "/");
+            pageRemap.push_back(-1);
+            packer->dirty = true;
+            continue;
         }
-        else if (PathToStr(file.extension) == "png")
-            LoadBitmap(prefix, file.path);
         
-        tinydir_next(&dir);
+        Point p;
+        p.x = sprite.x;
+        p.y = sprite.y;
+        p.rot = sprite.rot;
+        p.dupID = sprite.dupID >= 0 ? pageRemap[sprite.dupID] : -1;
+        pageRemap.push_back(static_cast<int>(packer->points.size()));
+        Bitmap* bitmap = TakeResident(sprite.file, manifest);
+        if (bitmap == nullptr)
+            bitmap = new Bitmap(sprite, optPremultiply, optTrim, optTrusted, cacheDir);
+        packer->Place(bitmap, p, optUnique);
+    }
+    
+    //Load the new and changed bitmaps
+    vector<Bitmap*> loaded(changed.size());
+    for (size_t i = 0; i < changed.size(); ++i)
+        loaded[i] = TakeResident(bitmapFiles[changed[i]], manifest);
+    ParallelFor(changed.size(), optJobs, [&](size_t i) {
+        if (loaded[i] == nullptr)
+            loaded[i] = NewBitmap(changed[i]);
+    });
+    for (auto bitmap : loaded)
+        failed = failed || bitmap->failed;
+    if (failed)
+    {
+        for (auto bitmap : loaded)
+            ReleaseBitmap(bitmap, manifest);
+        FreePackers(manifest);
+        return false;
+    }
+    sort(loaded.begin(), loaded.end(), [](const Bitmap* a, const Bitmap* b) {
+        return (a->width * a->height) < (b->width * b->height);
+    });
+    
+    //Biggest first, put each one back in its old slot if it still fits there,
+    //otherwise anywhere there's room left
+    while (!loaded.empty())
+    {
+        auto bitmap = loaded.back();
+        bool placed = false;
+        auto p = previous.find(bitmap->file);
+        if (p != previous.end() && layout.sprites[p->second].dupID < 0)
+        {
+            auto& sprite = layout.sprites[p->second];
+            placed = packers[sprite.page]->InsertAt(bitmap, sprite.x, sprite.y, optUnique);
+        }
+        for (size_t i = 0; !placed && i < packers.size(); ++i)
+            placed = packers[i]->Insert(bitmap, optUnique, optRotate);
+        if (!placed)
+        {
+            for (auto b : loaded)
+                ReleaseBitmap(b, manifest);
+            FreePackers(manifest);
+            return false;
+        }
+        loaded.pop_back();
+    }
+    
+    //Pages that changed size or went missing have to be written again too,
+    //and ones that ended up empty mean the page count should change
+    for (size_t i = 0; i < packers.size(); ++i)
+    {
+        auto packer = packers[i];
+        packer->Shrink();
+        if (packer->bitmaps.empty())
+        {
+            FreePackers(manifest);
+            return false;
+        }
+        FileStat stat;
+        if (packer->width != layout.pages[i].width || packer->height != layout.pages[i].height || !StatFile(prefix + to_string(i) + ".png", stat))
+            packer->dirty = true;
     }
     
-    tinydir_close(&dir);
+    if (optVerbose)
+        cout << "repacked " << changed.size() << " changed images incrementally" << endl;
+    return true;
+}
+
+static void SaveLayoutFile(const Manifest& manifest, const string& file)
+{
+    Layout layout;
+    layout.options = LayoutOptions();
+    for (size_t i = 0; i < packers.size(); ++i)
+    {
+        auto packer = packers[i];
+        LayoutPage page;
+        page.width = packer->width;
+        page.height = packer->height;
+        layout.pages.push_back(page);
+        for (size_t j = 0; j < packer->bitmaps.size(); ++j)
+        {
+            auto bitmap = packer->bitmaps[j];
+            auto& point = packer->points[j];
+            auto m = manifest.find(bitmap->file);
+            LayoutSprite sprite;
+            sprite.file = bitmap->file;
+            sprite.name = bitmap->name;
+            sprite.digest = m != manifest.end() ? m->second.digest : 0;
+            sprite.hashValue = bitmap->hashValue;
+            sprite.page = static_cast<int>(i);
+            sprite.x = point.x;
+            sprite.y = point.y;
+            sprite.dupID = point.dupID;
+            sprite.rot = point.rot;
+            sprite.width = bitmap->width;
+            sprite.height = bitmap->height;
+            sprite.frameX = bitmap->frameX;
+            sprite.frameY = bitmap->frameY;
+            sprite.frameW = bitmap->frameW;
+            sprite.frameH = bitmap->frameH;
+            layout.sprites.push_back(sprite);
+        }
+    }
+    SaveLayout(layout, file);
 }
 
 static void RemoveFile(string file)
@@ -198,103 +785,74 @@ static int GetPadding(const string& str)
     return 1;
 }
 
-int main(int argc, const char* argv[])
+static int GetJobs(const string& str)
 {
-    //Print out passed arguments
-    for (int i = 0; i < argc; ++i)
-        cout << argv[i] << ' ';
-    cout << endl;
-    
-    if (argc < 3)
-    {
-        cerr << "invalid input, expected: \"crunch [INPUT DIRECTORY] [OUTPUT PREFIX] [OPTIONS...]\"" << endl;
-        return EXIT_FAILURE;
-    }
-    
-    //Get the output directory and name
-    string outputDir, name;
-    SplitFileName(argv[1], &outputDir, &name, nullptr);
-    
-    //Get all the input files and directories
-    vector<string> inputs;
-    stringstream ss(argv[2]);
-    while (ss.good())
-    {
-        string inputStr;
-        getline(ss, inputStr, ',');
-        inputs.push_back(inputStr);
-    }
+    for (int i = 1; i <= 256; ++i)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid jobs value: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 1;
+}
+
+//Builds the atlas, returning EXIT_FAILURE if it can't be. When changed is
+//given, only those paths are looked at again, and the files that were found
+//last time are otherwise assumed to be the same
+static int Build(const string& outputDir, const string& name, const vector<string>& inputs, size_t argsHash, const unordered_set<string>* changed)
+{
+    //Find the input files once, they get hashed and loaded in this order
+    unordered_set<string> stale;
+    if (changed == nullptr)
+        FindInputs(inputs);
+    else
+        UpdateInputs(inputs, *changed, stale);
+    bitmapFiles.clear();
+    bitmapNames.clear();
+    for (auto& files : inputFiles)
+        for (auto& file : files)
+            FindBitmap(file.prefix, file.path);
     
-    //Get the options
-    optSize = 4096;
-    optPadding = 1;
-    optXml = false;
-    optBinary = false;
-    optJson = false;
-    optPremultiply = false;
-    optTrim = false;
-    optVerbose = false;
-    optForce = false;
-    optUnique = false;
-    for (int i = 3; i < argc; ++i)
+    //Make the bitmap cache folder, files are decoded as soon as they're hashed
+    if (optCache)
     {
-        string arg = argv[i];
-        if (arg == "-d" || arg == "--default")
-            optXml = optPremultiply = optTrim = optUnique = true;
-        else if (arg == "-x" || arg == "--xml")
-            optXml = true;
-        else if (arg == "-b" || arg == "--binary")
-            optBinary = true;
-        else if (arg == "-j" || arg == "--json")
-            optJson = true;
-        else if (arg == "-p" || arg == "--premultiply")
-            optPremultiply = true;
-        else if (arg == "-t" || arg == "--trim")
-            optTrim = true;
-        else if (arg == "-v" || arg == "--verbose")
-            optVerbose = true;
-        else if (arg == "-f" || arg == "--force")
-            optForce = true;
-        else if (arg == "-u" || arg == "--unique")
-            optUnique = true;
-        else if (arg == "-r" || arg == "--rotate")
-            optRotate = true;
-        else if (arg.find("--size") == 0)
-            optSize = GetPackSize(arg.substr(6));
-        else if (arg.find("-s") == 0)
-            optSize = GetPackSize(arg.substr(2));
-        else if (arg.find("--pad") == 0)
-            optPadding = GetPadding(arg.substr(5));
-        else if (arg.find("-p") == 0)
-            optPadding = GetPadding(arg.substr(2));
-        else
+        cacheDir = outputDir + name + "_cache/";
+        if (!MakeDir(cacheDir))
         {
-            cerr << "unexpected argument: " << arg << endl;
+            cerr << "failed to create cache folder: " << cacheDir << endl;
             return EXIT_FAILURE;
         }
     }
     
-    //Hash the arguments and input directories
-    size_t newHash = 0;
-    for (int i = 1; i < argc; ++i)
-        HashString(newHash, argv[i]);
-    for (size_t i = 0; i < inputs.size(); ++i)
+    //Hash the input files on top of the arguments. Files whose contents
+    //changed are decoded straight from the bytes that were hashed, unless
+    //only their headers are needed or they're still loaded from last time
+    size_t newHash = argsHash;
+    Manifest newManifest;
+    hashedBitmaps.assign(bitmapFiles.size(), nullptr);
+    bool scan = ScanHeaders();
+    auto decode = [&](size_t i, uint64_t digest, const unsigned char* png, size_t size) {
+        auto old = oldManifest.find(bitmapFiles[i]);
+        auto r = resident.find(bitmapFiles[i]);
+        if (scan || (old != oldManifest.end() && old->second.digest == digest) || (r != resident.end() && r->second.digest == digest))
+            return;
+        hashedBitmaps[i] = new Bitmap(bitmapFiles[i], bitmapNames[i], png, size, optPremultiply, optTrim, optLazy, optWatch, optTrusted, cacheDir);
+    };
+    if (!HashFiles(newHash, bitmapFiles, optJobs, oldManifest, newManifest, changed == nullptr ? nullptr : &stale, decode))
     {
-        if (inputs[i].rfind('.') == string::npos)
-            HashFiles(newHash, inputs[i]);
-        else
-            HashFile(newHash, inputs[i]);
+        FreeHashedBitmaps();
+        return EXIT_FAILURE;
     }
     
-    //Load the old hash
-    size_t oldHash;
-    if (LoadHash(oldHash, outputDir + name + ".hash"))
+    //Compare it to the old hash
+    if (hasManifest && !optForce && newHash == oldHash)
     {
-        if (!optForce && newHash == oldHash)
-        {
-            cout << "atlas is unchanged: " << name << endl;
-            return EXIT_SUCCESS;
-        }
+        //Files can be touched without changing, remember their new metadata
+        if (!SameManifest(oldManifest, newManifest))
+            SaveManifest(newHash, newManifest, outputDir + name + ".hash");
+        oldManifest.swap(newManifest);
+        FreeHashedBitmaps();
+        cout << "atlas is unchanged: " << name << endl;
+        return EXIT_SUCCESS;
     }
     
     /*-d  --default           use default settings (-x -p -t -u)
@@ -307,6 +865,14 @@ int main(int argc, const char* argv[])
     -f  --force             ignore the hash, forcing the packer to repack
     -u  --unique            remove duplicate bitmaps from the atlas
     -r  --rotate            enabled rotating bitmaps 90 degrees clockwise when packing
+    -c  --cache             keeps decoded bitmaps in a folder next to the atlas, so unchanged images aren't decoded again
+    -l  --lazy              frees the pixels of bitmaps after loading them and loads them again when writing the atlas
+    -i  --incremental       keeps unchanged images where they were in the last build and only places the ones that changed
+    -w  --watch             keeps running after packing, and packs again whenever the input files change
+    --trusted               skip checking the crcs of the input pngs, for inputs that are known to be intact
+    --search                packs with every heuristic and sort order at once, and keeps the result with the fewest and smallest pages
+    --batch                 packs whichever remaining bitmap fits best next instead of going biggest first, scoring them on all the --jobs threads
+    --skyline               packs with a skyline instead of maxrects, which is far faster for tens of thousands of small bitmaps but packs less tightly
     -s# --size#             max atlas size (# can be 4096, 2048, 1024, 512, or 256)
     -p# --pad#              padding between images (# can be from 0 to 16)*/
     
@@ -322,58 +888,100 @@ int main(int argc, const char* argv[])
         cout << "\t--force: " << (optForce ? "true" : "false") << endl;
         cout << "\t--unique: " << (optUnique ? "true" : "false") << endl;
         cout << "\t--rotate: " << (optRotate ? "true" : "false") << endl;
+        cout << "\t--cache: " << (optCache ? "true" : "false") << endl;
+        cout << "\t--lazy: " << (optLazy ? "true" : "false") << endl;
+        cout << "\t--incremental: " << (optIncremental ? "true" : "false") << endl;
+        cout << "\t--trusted: " << (optTrusted ? "true" : "false") << endl;
+        cout << "\t--watch: " << (optWatch ? "true" : "false") << endl;
+        cout << "\t--search: " << (optSearch ? "true" : "false") << endl;
+        cout << "\t--batch: " << (optBatch ? "true" : "false") << endl;
+        cout << "\t--skyline: " << (optSkyline ? "true" : "false") << endl;
         cout << "\t--size: " << optSize << endl;
         cout << "\t--pad: " << optPadding << endl;
+        cout << "\t--jobs: " << optJobs << endl;
     }
     
-    //Remove old files
+    //Load the layout of the last build before it gets removed, it's only
+    //any use if the sprites were packed with the same options
+    Layout oldLayout;
+    bool hasLayout = optIncremental && LoadLayout(oldLayout, outputDir + name + ".layout") && oldLayout.options == LayoutOptions();
+    
+    //Remove old files, an incremental build keeps the pngs of pages it doesn't change
     RemoveFile(outputDir + name + ".hash");
+    RemoveFile(outputDir + name + ".layout");
     RemoveFile(outputDir + name + ".bin");
     RemoveFile(outputDir + name + ".xml");
     RemoveFile(outputDir + name + ".json");
-    for (size_t i = 0; i < 16; ++i)
+    for (size_t i = hasLayout ? oldLayout.pages.size() : 0; i < 16; ++i)
         RemoveFile(outputDir + name + to_string(i) + ".png");
     
     //Load the bitmaps from all the input files and directories
     if (optVerbose)
+    {
         cout << "loading images..." << endl;
-    for (size_t i = 0; i < inputs.size(); ++i)
+        for (auto& file : bitmapFiles)
+            cout << '\t' << file << endl;
+    }
+    
+    //Try to only place the images that changed since the last build, and if
+    //they don't fit, throw the old layout away and pack everything again
+    bool failed = false;
+    bool incremental = hasLayout && PackIncremental(oldLayout, newManifest, outputDir + name, failed);
+    if (hasLayout && !incremental && !failed)
     {
-        if (inputs[i].rfind('.') != string::npos)
-            LoadBitmap("", inputs[i]);
-        else
-            LoadBitmaps(inputs[i], "");
+        if (optVerbose)
+            cout << "changed images don't fit, packing everything again" << endl;
+        for (size_t i = 0; i < 16; ++i)
+            RemoveFile(outputDir + name + to_string(i) + ".png");
+    }
+    if (!incremental && !failed)
+        LoadBitmaps(newManifest);
+    FreeHashedBitmaps();
+    if (failed || LoadFailed())
+    {
+        FreeBuild(newManifest);
+        return EXIT_FAILURE;
     }
     
-    //Sort the bitmaps by area
-    sort(bitmaps.begin(), bitmaps.end(), [](const Bitmap* a, const Bitmap* b) {
-        return (a->width * a->height) < (b->width * b->height);
-    });
+    //Loading can find files that changed without their metadata changing
+    newHash = argsHash;
+    HashManifest(newHash, bitmapFiles, newManifest);
     
-    //Pack the bitmaps
-    while (!bitmaps.empty())
+    //Pack the bitmaps sorted by area, or search for the best way to pack them
+    bool packed;
+    if (optSearch && !bitmaps.empty())
+        packed = SearchPacking(name);
+    else
     {
-        if (optVerbose)
-            cout << "packing " << bitmaps.size() << " images..." << endl;
-        auto packer = new Packer(optSize, optSize, optPadding);
-        packer->Pack(bitmaps, optVerbose, optUnique, optRotate);
-        packers.push_back(packer);
-        if (optVerbose)
-            cout << "finished packing: " << name << to_string(packers.size() - 1) << " (" << packer->width << " x " << packer->height << ')' << endl;
+        sort(bitmaps.begin(), bitmaps.end(), CompareArea);
+        packed = PackPages(bitmaps, packers, ChosenMethod(), optJobs, optVerbose, name);
+    }
+    if (!packed)
+    {
+        cerr << "packing failed, could not fit bitmap: " << (bitmaps.back())->name << endl;
+        FreeBuild(newManifest);
+        return EXIT_FAILURE;
+    }
     
-        if (packer->bitmaps.empty())
-        {
-            cerr << "packing failed, could not fit bitmap: " << (bitmaps.back())->name << endl;
-            return EXIT_FAILURE;
-        }
+    //Comparing pixels for --unique can load bitmaps again, and find their png changed
+    if (LoadFailed())
+    {
+        FreeBuild(newManifest);
+        return EXIT_FAILURE;
     }
     
-    //Save the atlas image
+    //Save the atlas image, unless it's a page an incremental build didn't touch
     for (size_t i = 0; i < packers.size(); ++i)
     {
+        if (!packers[i]->dirty)
+            continue;
         if (optVerbose)
             cout << "writing png: " << outputDir << name << to_string(i) << ".png" << endl;
-        packers[i]->SavePng(outputDir + name + to_string(i) + ".png");
+        if (!packers[i]->SavePng(outputDir + name + to_string(i) + ".png", optJobs))
+        {
+            FreeBuild(newManifest);
+            return EXIT_FAILURE;
+        }
     }
     
     //Save the atlas binary
@@ -424,8 +1032,180 @@ int main(int argc, const char* argv[])
         json << '}';
     }
     
-    //Save the new hash
-    SaveHash(newHash, outputDir + name + ".hash");
+    //Save the layout for the next incremental build
+    if (optIncremental)
+        SaveLayoutFile(newManifest, outputDir + name + ".layout");
+    
+    //Save the new hash and manifest
+    SaveManifest(newHash, newManifest, outputDir + name + ".hash");
+    
+    //Keep the manifest for the next build in watch mode, and let go of any
+    //bitmaps that were kept for files that are gone now
+    FreePackers(newManifest);
+    for (auto r = resident.begin(); r != resident.end(); )
+    {
+        if (newManifest.count(r->first) == 0)
+        {
+            delete r->second.bitmap;
+            r = resident.erase(r);
+        }
+        else
+            ++r;
+    }
+    oldHash = newHash;
+    oldManifest.swap(newManifest);
+    hasManifest = true;
     
     return EXIT_SUCCESS;
 }
+
+int main(int argc, const char* argv[])
+{
+    //Print out passed arguments
+    for (int i = 0; i < argc; ++i)
+        cout << argv[i] << ' ';
+    cout << endl;
+    
+    if (argc < 3)
+    {
+        cerr << "invalid input, expected: \"crunch [INPUT DIRECTORY] [OUTPUT PREFIX] [OPTIONS...]\"" << endl;
+        return EXIT_FAILURE;
+    }
+    
+    //Get the output directory and name
+    string outputDir, name;
+    SplitFileName(argv[1], &outputDir, &name, nullptr);
+    
+    //Get all the input files and directories
+    vector<string> inputs;
+    stringstream ss(argv[2]);
+    while (ss.good())
+    {
+        string inputStr;
+        getline(ss, inputStr, ',');
+        inputs.push_back(inputStr);
+    }
+    
+    //Get the options
+    optSize = 4096;
+    optPadding = 1;
+    optXml = false;
+    optBinary = false;
+    optJson = false;
+    optPremultiply = false;
+    optTrim = false;
+    optVerbose = false;
+    optForce = false;
+    optUnique = false;
+    optCache = false;
+    optLazy = false;
+    optIncremental = false;
+    optTrusted = false;
+    optWatch = false;
+    optSearch = false;
+    optBatch = false;
+    optSkyline = false;
+    optJobs = 1;
+    for (int i = 3; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "-d" || arg == "--default")
+            optXml = optPremultiply = optTrim = optUnique = true;
+        else if (arg == "-x" || arg == "--xml")
+            optXml = true;
+        else if (arg == "-b" || arg == "--binary")
+            optBinary = true;
+        else if (arg == "-j" || arg == "--json")
+            optJson = true;
+        else if (arg == "-p" || arg == "--premultiply")
+            optPremultiply = true;
+        else if (arg == "-t" || arg == "--trim")
+            optTrim = true;
+        else if (arg == "-v" || arg == "--verbose")
+            optVerbose = true;
+        else if (arg == "-f" || arg == "--force")
+            optForce = true;
+        else if (arg == "-u" || arg == "--unique")
+            optUnique = true;
+        else if (arg == "-r" || arg == "--rotate")
+            optRotate = true;
+        else if (arg == "-c" || arg == "--cache")
+            optCache = true;
+        else if (arg == "-l" || arg == "--lazy")
+            optLazy = true;
+        else if (arg == "-i" || arg == "--incremental")
+            optIncremental = true;
+        else if (arg == "-w" || arg == "--watch")
+            optWatch = true;
+        else if (arg == "--trusted")
+            optTrusted = true;
+        else if (arg == "--search")
+            optSearch = true;
+        else if (arg == "--batch")
+            optBatch = true;
+        else if (arg == "--skyline")
+            optSkyline = true;
+        else if (arg.find("--jobs") == 0)
+            optJobs = GetJobs(arg.substr(6));
+        else if (arg.find("--size") == 0)
+            optSize = GetPackSize(arg.substr(6));
+        else if (arg.find("-s") == 0)
+            optSize = GetPackSize(arg.substr(2));
+        else if (arg.find("--pad") == 0)
+            optPadding = GetPadding(arg.substr(5));
+        else if (arg.find("-p") == 0)
+            optPadding = GetPadding(arg.substr(2));
+        else
+        {
+            cerr << "unexpected argument: " << arg << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    
+    //Load the manifest from the last run, files that haven't changed since
+    //then are known by their metadata and don't need to be read again
+    oldHash = 0;
+    hasManifest = LoadManifest(oldHash, oldManifest, outputDir + name + ".hash");
+    
+    //Hash the arguments, the input files get hashed on top of them
+    size_t argsHash = 0;
+    for (int i = 1; i < argc; ++i)
+        HashString(argsHash, argv[i]);
+    
+    int result = Build(outputDir, name, inputs, argsHash, nullptr);
+    if (!optWatch)
+        return result;
+    
+    //Watch the input folders, and the folders of input files, for changes
+    DirWatcher watcher;
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (IsFileInput(inputs[i]))
+            watcher.Add(WatchedDir(inputs[i]), false);
+        else
+            watcher.Add(inputs[i], true);
+    }
+    
+    //Build again whenever something changes, only --force the first one. A
+    //failed build leaves nothing behind, so the next one starts from scratch,
+    //and what changed before it is looked at again along with what's new
+    optForce = false;
+    cout << "watching for changes..." << endl;
+    unordered_set<string> changed;
+    bool rescan = false;
+    while (true)
+    {
+        if (result != EXIT_SUCCESS)
+            hasManifest = false;
+        else
+        {
+            changed.clear();
+            rescan = false;
+        }
+        vector<string> paths;
+        if (!watcher.Wait(paths))
+            rescan = true;
+        changed.insert(paths.begin(), paths.end());
+        result = Build(outputDir, name, inputs, argsHash, rescan ? nullptr : &changed);
+    }
+}
@@ -27,25 +27,81 @@
 #include "packer.hpp"
 #include "MaxRectsBinPack.h"
 #include "GuillotineBinPack.h"
+#include "SkylineBinPack.h"
 #include "binary.hpp"
+#include "parallel.hpp"
 #include <iostream>
 #include <algorithm>
 
 using namespace std;
 using namespace rbp;
 
-Packer::Packer(int width, int height, int pad)
-: width(width), height(height), pad(pad)
+PackMethod::PackMethod()
+: engine(MaxRects)
+, maxRectsChoice(MaxRectsBinPack::RectBestShortSideFit)
+, guillotineChoice(GuillotineBinPack::RectBestAreaFit)
+, guillotineSplit(GuillotineBinPack::SplitShorterLeftoverAxis)
+, skylineChoice(SkylineBinPack::LevelBottomLeft)
 {
     
 }
 
-void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate)
+string PackMethod::Name() const
+{
+    static const char* maxRectsChoices[] = { "bssf", "blsf", "baf", "bl", "cp" };
+    static const char* guillotineChoices[] = { "baf", "bssf", "blsf", "waf", "wssf", "wlsf" };
+    static const char* guillotineSplits[] = { "slas", "llas", "minas", "maxas", "sas", "las" };
+    static const char* skylineChoices[] = { "bl", "mw" };
+    if (engine == Guillotine)
+        return string("guillotine ") + guillotineChoices[guillotineChoice] + ' ' + guillotineSplits[guillotineSplit];
+    if (engine == Skyline)
+        return string("skyline ") + skylineChoices[skylineChoice];
+    return string("maxrects ") + maxRectsChoices[maxRectsChoice];
+}
+
+vector<PackMethod> AllPackMethods()
+{
+    vector<PackMethod> methods;
+    for (int i = MaxRectsBinPack::RectBestShortSideFit; i <= MaxRectsBinPack::RectContactPointRule; ++i)
+    {
+        PackMethod method;
+        method.maxRectsChoice = static_cast<MaxRectsBinPack::FreeRectChoiceHeuristic>(i);
+        methods.push_back(method);
+    }
+    for (int i = GuillotineBinPack::RectBestAreaFit; i <= GuillotineBinPack::RectWorstLongSideFit; ++i)
+    {
+        for (int j = GuillotineBinPack::SplitShorterLeftoverAxis; j <= GuillotineBinPack::SplitLongerAxis; ++j)
+        {
+            PackMethod method;
+            method.engine = PackMethod::Guillotine;
+            method.guillotineChoice = static_cast<GuillotineBinPack::FreeRectChoiceHeuristic>(i);
+            method.guillotineSplit = static_cast<GuillotineBinPack::GuillotineSplitHeuristic>(j);
+            methods.push_back(method);
+        }
+    }
+    for (int i = SkylineBinPack::LevelBottomLeft; i <= SkylineBinPack::LevelMinWasteFit; ++i)
+    {
+        PackMethod method;
+        method.engine = PackMethod::Skyline;
+        method.skylineChoice = static_cast<SkylineBinPack::LevelChoiceHeuristic>(i);
+        methods.push_back(method);
+    }
+    return methods;
+}
+
+//Only the bin the method packs with is sized. Place() marks the maxrects bin,
+//so incremental builds always pack with the default method
+Packer::Packer(int width, int height, int pad, const PackMethod& method)
+: width(width), height(height), pad(pad), dirty(true), method(method)
+, bin(method.engine == PackMethod::MaxRects ? width : 0, method.engine == PackMethod::MaxRects ? height : 0)
+, guillotine(method.engine == PackMethod::Guillotine ? width : 0, method.engine == PackMethod::Guillotine ? height : 0)
+, skyline(method.engine == PackMethod::Skyline ? width : 0, method.engine == PackMethod::Skyline ? height : 0, true)
 {
-    MaxRectsBinPack packer(width, height);
     
-    int ww = 0;
-    int hh = 0;
+}
+
+void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate)
+{
     while (!bitmaps.empty())
     {
         auto bitmap = bitmaps.back();
@@ -53,67 +109,249 @@ void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rota
         if (verbose)
             cout << '\t' << bitmaps.size() << ": " << bitmap->name << endl;
         
-        //Check to see if this is a duplicate of an already packed bitmap
+        if (!Insert(bitmap, unique, rotate))
+            break;
+        bitmaps.pop_back();
+    }
+    
+    Shrink();
+}
+
+static bool AddDuplicate(Packer* packer, Bitmap* bitmap)
+{
+    //Check to see if this is a duplicate of an already packed bitmap
+    auto di = packer->dupLookup.find(bitmap->hashValue);
+    if (di != packer->dupLookup.end() && bitmap->Equals(packer->bitmaps[di->second]))
+    {
+        Point p = packer->points[di->second];
+        p.dupID = di->second;
+        packer->points.push_back(p);
+        packer->bitmaps.push_back(bitmap);
+        return true;
+    }
+    return false;
+}
+
+//Batch packing places whichever bitmap fits best next instead of going
+//biggest first, so every remaining bitmap gets scored for every placement
+void Packer::PackBatch(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate, int jobs)
+{
+    if (method.engine != PackMethod::MaxRects)
+    {
+        Pack(bitmaps, verbose, unique, rotate);
+        return;
+    }
+    
+    //Duplicates are left out of the batch, they go wherever the bitmap they
+    //copy does. Listing the rest biggest first breaks ties the way Pack does
+    vector<size_t> batch;
+    vector<rbp::RectSize> sizes;
+    vector<size_t> copies;
+    vector<size_t> copyOf;
+    unordered_multimap<size_t, size_t> batchLookup;
+    vector<char> packed(bitmaps.size(), false);
+    for (size_t i = bitmaps.size(); i-- > 0;)
+    {
+        auto bitmap = bitmaps[i];
         if (unique)
         {
-            auto di = dupLookup.find(bitmap->hashValue);
-            if (di != dupLookup.end() && bitmap->Equals(this->bitmaps[di->second]))
+            if (AddDuplicate(this, bitmap))
+            {
+                packed[i] = true;
+                continue;
+            }
+            auto range = batchLookup.equal_range(bitmap->hashValue);
+            auto j = find_if(range.first, range.second, [&](const pair<const size_t, size_t>& entry) {
+                return bitmap->Equals(bitmaps[batch[entry.second]]);
+            });
+            if (j != range.second)
             {
-                Point p = points[di->second];
-                p.dupID = di->second;
-                points.push_back(p);
-                this->bitmaps.push_back(bitmap);
-                bitmaps.pop_back();
+                copies.push_back(i);
+                copyOf.push_back(j->second);
                 continue;
             }
+            batchLookup.emplace(bitmap->hashValue, batch.size());
         }
+        rbp::RectSize size;
+        size.width = bitmap->width + pad;
+        size.height = bitmap->height + pad;
+        sizes.push_back(size);
+        batch.push_back(i);
+    }
+    
+    if (verbose)
+        cout << '\t' << "scoring " << sizes.size() << " images on " << jobs << " threads..." << endl;
+    vector<Rect> rects;
+    bin.Insert(sizes, rects, rotate, method.maxRectsChoice, jobs);
+    
+    vector<int> placedAt(batch.size(), -1);
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        if (rects[i].width == 0 || rects[i].height == 0)
+            continue;
+        auto bitmap = bitmaps[batch[i]];
+        if (verbose)
+            cout << '\t' << points.size() + 1 << ": " << bitmap->name << endl;
+        if (unique)
+            dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
         
-        //If it's not a duplicate, pack it into the atlas
-        {
-            Rect rect = packer.Insert(bitmap->width + pad, bitmap->height + pad, rotate, MaxRectsBinPack::RectBestShortSideFit);
-            
-            if (rect.width == 0 || rect.height == 0)
-                break;
-            
-            if (unique)
-                dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
-            
-            //Check if we rotated it
-            Point p;
-            p.x = rect.x;
-            p.y = rect.y;
-            p.dupID = -1;
-            p.rot = rotate && bitmap->width != (rect.width - pad);
-            
-            points.push_back(p);
-            this->bitmaps.push_back(bitmap);
-            bitmaps.pop_back();
-            
-            ww = max(rect.x + rect.width, ww);
-            hh = max(rect.y + rect.height, hh);
-        }
+        Point p;
+        p.x = rects[i].x;
+        p.y = rects[i].y;
+        p.dupID = -1;
+        p.rot = rotate && bitmap->width != (rects[i].width - pad);
+        placedAt[i] = static_cast<int>(points.size());
+        points.push_back(p);
+        this->bitmaps.push_back(bitmap);
+        packed[batch[i]] = true;
+    }
+    for (size_t i = 0; i < copies.size(); ++i)
+    {
+        int original = placedAt[copyOf[i]];
+        if (original < 0)
+            continue;
+        Point p = points[original];
+        p.dupID = original;
+        points.push_back(p);
+        this->bitmaps.push_back(bitmaps[copies[i]]);
+        packed[copies[i]] = true;
+    }
+    
+    //Whatever didn't fit stays behind in the order it came in, for the next page
+    size_t numLeft = 0;
+    for (size_t i = 0; i < bitmaps.size(); ++i)
+        if (!packed[i])
+            bitmaps[numLeft++] = bitmaps[i];
+    bitmaps.resize(numLeft);
+    
+    dirty = true;
+    Shrink();
+}
+
+bool Packer::Insert(Bitmap* bitmap, bool unique, bool rotate)
+{
+    if (unique && AddDuplicate(this, bitmap))
+        return true;
+    
+    //If it's not a duplicate, pack it into the atlas. Merging guillotine free
+    //rects goes through all pairs of them on every insert, which takes minutes
+    //once there are thousands of bitmaps, so they're left unmerged
+    Rect rect;
+    if (method.engine == PackMethod::Guillotine)
+        rect = guillotine.Insert(bitmap->width + pad, bitmap->height + pad, rotate, false, method.guillotineChoice, method.guillotineSplit);
+    else if (method.engine == PackMethod::Skyline)
+        rect = skyline.Insert(bitmap->width + pad, bitmap->height + pad, rotate, method.skylineChoice);
+    else
+        rect = bin.Insert(bitmap->width + pad, bitmap->height + pad, rotate, method.maxRectsChoice);
+    if (rect.width == 0 || rect.height == 0)
+        return false;
+    
+    if (unique)
+        dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
+    
+    //Check if we rotated it
+    Point p;
+    p.x = rect.x;
+    p.y = rect.y;
+    p.dupID = -1;
+    p.rot = rotate && bitmap->width != (rect.width - pad);
+    
+    points.push_back(p);
+    bitmaps.push_back(bitmap);
+    dirty = true;
+    return true;
+}
+
+bool Packer::InsertAt(Bitmap* bitmap, int x, int y, bool unique)
+{
+    if (unique && AddDuplicate(this, bitmap))
+        return true;
+    
+    //It fits if it stays inside the page without overlapping anything packed
+    int w = bitmap->width + pad;
+    int h = bitmap->height + pad;
+    if (x < 0 || y < 0 || x + w > width || y + h > height)
+        return false;
+    for (size_t i = 0, j = points.size(); i < j; ++i)
+    {
+        if (points[i].dupID >= 0)
+            continue;
+        int pw = (points[i].rot ? bitmaps[i]->height : bitmaps[i]->width) + pad;
+        int ph = (points[i].rot ? bitmaps[i]->width : bitmaps[i]->height) + pad;
+        if (x < points[i].x + pw && points[i].x < x + w && y < points[i].y + ph && points[i].y < y + h)
+            return false;
     }
     
-    while (width / 2 >= ww)
+    Point p;
+    p.x = x;
+    p.y = y;
+    p.dupID = -1;
+    p.rot = false;
+    Place(bitmap, p, unique);
+    dirty = true;
+    return true;
+}
+
+void Packer::Place(Bitmap* bitmap, const Point& point, bool unique)
+{
+    //Mark where it goes as used, so nothing inserted later lands on top of it
+    if (point.dupID < 0)
+    {
+        Rect rect;
+        rect.x = point.x;
+        rect.y = point.y;
+        rect.width = (point.rot ? bitmap->height : bitmap->width) + pad;
+        rect.height = (point.rot ? bitmap->width : bitmap->height) + pad;
+        bin.PlaceRect(rect);
+        if (unique)
+            dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
+    }
+    points.push_back(point);
+    bitmaps.push_back(bitmap);
+}
+
+void Packer::Shrink()
+{
+    int ww = 0;
+    int hh = 0;
+    for (size_t i = 0, j = points.size(); i < j; ++i)
+    {
+        if (points[i].dupID >= 0)
+            continue;
+        ww = max(points[i].x + (points[i].rot ? bitmaps[i]->height : bitmaps[i]->width) + pad, ww);
+        hh = max(points[i].y + (points[i].rot ? bitmaps[i]->width : bitmaps[i]->height) + pad, hh);
+    }
+    
+    while (width / 2 >= ww && width > 1)
         width /= 2;
-    while( height / 2 >= hh)
+    while (height / 2 >= hh && height > 1)
         height /= 2;
 }
 
-void Packer::SavePng(const string& file)
+bool Packer::SavePng(const string& file, int jobs)
 {
     Bitmap bitmap(width, height);
-    for (size_t i = 0, j = bitmaps.size(); i < j; ++i)
-    {
-        if (points[i].dupID < 0)
-        {
-            if (points[i].rot)
-                bitmap.CopyPixelsRot(bitmaps[i], points[i].x, points[i].y);
-            else
-                bitmap.CopyPixels(bitmaps[i], points[i].x, points[i].y);
-        }
-    }
-    bitmap.SaveAs(file);
+    
+    //Packed bitmaps never overlap, so they can be copied in concurrently.
+    //Bitmaps that were only header scanned get decoded right here, and are
+    //freed again as soon as they're in the atlas
+    ParallelFor(bitmaps.size(), jobs, [&](size_t i) {
+        if (points[i].dupID >= 0)
+            return;
+        bool load = bitmaps[i]->data == nullptr;
+        if (load && !bitmaps[i]->LoadPixels())
+            return;
+        if (points[i].rot)
+            bitmap.CopyPixelsRot(bitmaps[i], points[i].x, points[i].y);
+        else
+            bitmap.CopyPixels(bitmaps[i], points[i].x, points[i].y);
+        if (load)
+            bitmaps[i]->FreePixels();
+    });
+    for (auto b : bitmaps)
+        if (b->failed)
+            return false;
+    return bitmap.SaveAs(file);
 }
 
 void Packer::SaveXml(const string& name, ofstream& xml, bool trim, bool rotate)
@@ -29,8 +29,12 @@
 
 #include <vector>
 #include <fstream>
+#include <string>
 #include <unordered_map>
 #include "bitmap.hpp"
+#include "MaxRectsBinPack.h"
+#include "GuillotineBinPack.h"
+#include "SkylineBinPack.h"
 
 using namespace std;
 
@@ -42,19 +46,53 @@ struct Point
     bool rot;
 };
 
+//Which bin packer and heuristics bitmaps are placed with, the default is
+//the one crunch has always packed with
+struct PackMethod
+{
+    enum Engine
+    {
+        MaxRects,
+        Guillotine,
+        Skyline
+    };
+    
+    Engine engine;
+    rbp::MaxRectsBinPack::FreeRectChoiceHeuristic maxRectsChoice;
+    rbp::GuillotineBinPack::FreeRectChoiceHeuristic guillotineChoice;
+    rbp::GuillotineBinPack::GuillotineSplitHeuristic guillotineSplit;
+    rbp::SkylineBinPack::LevelChoiceHeuristic skylineChoice;
+    
+    PackMethod();
+    string Name() const;
+};
+
+//Every heuristic of all the bin packers, starting with the default one
+vector<PackMethod> AllPackMethods();
+
 struct Packer
 {
     int width;
     int height;
     int pad;
+    bool dirty;
     
     vector<Bitmap*> bitmaps;
     vector<Point> points;
     unordered_map<size_t, int> dupLookup;
+    PackMethod method;
+    rbp::MaxRectsBinPack bin;
+    rbp::GuillotineBinPack guillotine;
+    rbp::SkylineBinPack skyline;
     
-    Packer(int width, int height, int pad);
+    Packer(int width, int height, int pad, const PackMethod& method = PackMethod());
     void Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate);
-    void SavePng(const string& file);
+    void PackBatch(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate, int jobs);
+    bool Insert(Bitmap* bitmap, bool unique, bool rotate);
+    bool InsertAt(Bitmap* bitmap, int x, int y, bool unique);
+    void Place(Bitmap* bitmap, const Point& point, bool unique);
+    void Shrink();
+    bool SavePng(const string& file, int jobs);
     void SaveXml(const string& name, ofstream& xml, bool trim, bool rotate);
     void SaveBin(const string& name, ofstream& bin, bool trim, bool rotate);
     void SaveJson(const string& name, ofstream& json, bool trim, bool rotate);
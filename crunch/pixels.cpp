@@ -0,0 +1,257 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#include "pixels.hpp"
+#include <algorithm>
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define PIXELS_X86
+#include <immintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+#define PIXELS_TARGET_AVX2
+#else
+#define PIXELS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace std;
+
+//Exact division by 255 with rounding, valid for any product of two bytes
+static inline uint32_t MulDiv255(uint32_t c, uint32_t a)
+{
+    uint32_t t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void PremultiplyScalar(uint32_t* pixels, size_t count)
+{
+    uint32_t c,a,r,g,b;
+    for (size_t i = 0; i < count; ++i)
+    {
+        c = pixels[i];
+        a = c >> 24;
+        if (a == 255)
+            continue;
+        if (a == 0)
+        {
+            pixels[i] = 0;
+            continue;
+        }
+        r = MulDiv255(c & 0xff, a);
+        g = MulDiv255((c >> 8) & 0xff, a);
+        b = MulDiv255((c >> 16) & 0xff, a);
+        pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
+    }
+}
+
+#ifdef PIXELS_X86
+
+//Multiplies two unpacked pixels (8 x 16-bit channels) by their own alpha
+static inline __m128i PremultiplyWide(__m128i c)
+{
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, a), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static void PremultiplySSE2(uint32_t* pixels, size_t count)
+{
+    const __m128i alphaMask = _mm_set1_epi32(static_cast<int>(0xff000000));
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i* p = reinterpret_cast<__m128i*>(pixels + i);
+        __m128i c = _mm_loadu_si128(p);
+        __m128i a = _mm_and_si128(c, alphaMask);
+        
+        //Skip runs that are fully opaque, and clear runs that are fully transparent
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alphaMask)) == 0xffff)
+            continue;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xffff)
+        {
+            _mm_storeu_si128(p, zero);
+            continue;
+        }
+        
+        __m128i lo = PremultiplyWide(_mm_unpacklo_epi8(c, zero));
+        __m128i hi = PremultiplyWide(_mm_unpackhi_epi8(c, zero));
+        __m128i rgb = _mm_andnot_si128(alphaMask, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128(p, _mm_or_si128(rgb, a));
+    }
+    PremultiplyScalar(pixels + i, count - i);
+}
+
+PIXELS_TARGET_AVX2 static inline __m256i PremultiplyWideAVX2(__m256i c)
+{
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(c, a), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+PIXELS_TARGET_AVX2 static void PremultiplyAVX2(uint32_t* pixels, size_t count)
+{
+    const __m256i alphaMask = _mm256_set1_epi32(static_cast<int>(0xff000000));
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i* p = reinterpret_cast<__m256i*>(pixels + i);
+        __m256i c = _mm256_loadu_si256(p);
+        __m256i a = _mm256_and_si256(c, alphaMask);
+        
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, alphaMask)) == -1)
+            continue;
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, zero)) == -1)
+        {
+            _mm256_storeu_si256(p, zero);
+            continue;
+        }
+        
+        //Unpacking and packing both stay within 128-bit lanes, so pixel order is preserved
+        __m256i lo = PremultiplyWideAVX2(_mm256_unpacklo_epi8(c, zero));
+        __m256i hi = PremultiplyWideAVX2(_mm256_unpackhi_epi8(c, zero));
+        __m256i rgb = _mm256_andnot_si256(alphaMask, _mm256_packus_epi16(lo, hi));
+        _mm256_storeu_si256(p, _mm256_or_si256(rgb, a));
+    }
+    PremultiplySSE2(pixels + i, count - i);
+}
+
+static bool CpuHasAVX2()
+{
+#if defined _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+//Returns the index of the first pixel with a non-zero alpha, or count if there is none
+static int FirstOpaque(const uint32_t* row, int count)
+{
+    int i = 0;
+#ifdef PIXELS_X86
+    //Test 16 pixels per step, then find the exact one with the scalar loop below
+    const __m128i alphaMask = _mm_set1_epi32(static_cast<int>(0xff000000));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i* p = reinterpret_cast<const __m128i*>(row + i);
+        __m128i a = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(a, alphaMask), zero)) != 0xffff)
+            break;
+    }
+#endif
+    while (i < count && (row[i] >> 24) == 0)
+        ++i;
+    return i;
+}
+
+//Returns the index of the last pixel with a non-zero alpha, or -1 if there is none
+static int LastOpaque(const uint32_t* row, int count)
+{
+    int i = count;
+#ifdef PIXELS_X86
+    const __m128i alphaMask = _mm_set1_epi32(static_cast<int>(0xff000000));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i >= 16; i -= 16)
+    {
+        const __m128i* p = reinterpret_cast<const __m128i*>(row + i - 16);
+        __m128i a = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(a, alphaMask), zero)) != 0xffff)
+            break;
+    }
+#endif
+    while (i > 0 && (row[i - 1] >> 24) == 0)
+        --i;
+    return i - 1;
+}
+
+bool FindOpaqueBounds(const uint32_t* pixels, int w, int h, int& minX, int& minY, int& maxX, int& maxY)
+{
+    //Top edge: the first row with anything in it
+    minY = 0;
+    while (minY < h && FirstOpaque(pixels + minY * w, w) == w)
+        ++minY;
+    if (minY == h)
+        return false;
+    
+    //Bottom edge: we know row minY is opaque, so this always stops
+    maxY = h - 1;
+    while (FirstOpaque(pixels + maxY * w, w) == w)
+        --maxY;
+    
+    //Left and right edges: each row only needs to look past the current bounds
+    minX = w;
+    maxX = -1;
+    for (int y = minY; y <= maxY; ++y)
+    {
+        const uint32_t* row = pixels + y * w;
+        if (minX > 0)
+            minX = min(FirstOpaque(row, minX), minX);
+        if (maxX < w - 1)
+        {
+            int x = LastOpaque(row + maxX + 1, w - maxX - 1);
+            if (x >= 0)
+                maxX += x + 1;
+        }
+    }
+    return true;
+}
+
+typedef void (*PremultiplyFunc)(uint32_t*, size_t);
+
+static PremultiplyFunc GetPremultiplyFunc()
+{
+#ifdef PIXELS_X86
+    if (CpuHasAVX2())
+        return PremultiplyAVX2;
+    return PremultiplySSE2;
+#else
+    return PremultiplyScalar;
+#endif
+}
+
+void PremultiplyPixels(uint32_t* pixels, size_t count)
+{
+    static const PremultiplyFunc func = GetPremultiplyFunc();
+    func(pixels, count);
+}
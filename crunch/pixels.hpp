@@ -0,0 +1,42 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#ifndef pixels_hpp
+#define pixels_hpp
+
+#include <cstddef>
+#include <cstdint>
+
+//Premultiplies RGBA pixels by their alpha, rounding each channel to the nearest value
+//the same way (c * a + 127) / 255 does. Uses SSE2 or AVX2 when the CPU supports it.
+void PremultiplyPixels(uint32_t* pixels, size_t count);
+
+//Finds the smallest rectangle containing every pixel with a non-zero alpha. Rows are scanned
+//inwards from the top and bottom and columns from the left and right, so only the transparent
+//border and the first opaque pixels are read. Returns false if the image is fully transparent.
+bool FindOpaqueBounds(const uint32_t* pixels, int w, int h, int& minX, int& minY, int& maxX, int& maxY);
+
+#endif